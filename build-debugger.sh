@@ -1 +1 @@
-clear && clang -fpic -std=c99 -g main.c -o main && ./build-test.sh && read && lldb ./main
+clear && clang -fpic -std=c99 -g -frounding-math main.c -o main -lm && ./build-test.sh && read && lldb ./main
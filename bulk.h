@@ -0,0 +1,29 @@
+// guest side of the custom-0 bulk memory instructions (opcode 0b0001011), run on the host by the emulator:
+// a0 = dst, a1 = src / fill byte, a2 = length, funct3 picks MEMCPY (0), MEMSET (1) or MEMMOVE (2)
+
+#define BULK_OP(funct3, dst, src, len) \
+  do \
+  { \
+    register unsigned long a0 __asm__("a0") = (unsigned long)(dst); \
+    register unsigned long a1 __asm__("a1") = (unsigned long)(src); \
+    register unsigned long a2 __asm__("a2") = (unsigned long)(len); \
+    __asm__ volatile (".insn r 0x0b, " #funct3 ", 0, x0, a0, a1" : : "r"(a0), "r"(a1), "r"(a2) : "memory"); \
+  } while (0)
+
+
+static inline void bulk_memcpy(void *dst, const void *src, unsigned int len) // must not overlap
+{
+  BULK_OP(0, dst, src, len);
+}
+
+
+static inline void bulk_memset(void *dst, unsigned char fill, unsigned int len)
+{
+  BULK_OP(1, dst, fill, len);
+}
+
+
+static inline void bulk_memmove(void *dst, const void *src, unsigned int len)
+{
+  BULK_OP(2, dst, src, len);
+}
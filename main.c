@@ -1,9 +1,26 @@
+#define _DEFAULT_SOURCE
+
 #include <stdint.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
+#include <math.h>
+#include <fenv.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
 
 #define MAX_MEM_BLOCKS 10000000
@@ -11,6 +28,11 @@ uint32_t mem_ptr = 0;
 uint32_t mem_index[MAX_MEM_BLOCKS];
 uint8_t mem_block[MAX_MEM_BLOCKS];
 
+// the binary is mapped privately from its file at address 0: instances running the same image share its pages
+// through the page cache, and a page is only copied if one of them writes to it (a debugger's breakpoints)
+uint8_t *code_mem = NULL;
+uint32_t code_mem_ptr = 0; // size of code_mem, guest writes below it are faults
+
 int silent = 0;
 
 
@@ -18,11 +40,63 @@ typedef struct
 {
   uint32_t regs[32];
   uint32_t pc;
+  uint32_t fregs[32];
+  uint32_t fcsr;
 } cpu_t;
 
+cpu_t cpu;
+
+uint64_t inst_count;
+uint64_t next_event = UINT64_MAX; // inst_count at which execute() leaves the fast path and calls handle_events()
+
+
+void schedule_event(uint64_t at)
+{
+  if (at < next_event)
+    next_event = at;
+}
+
+
+// why execute() stopped early, also the process exit code
+#define RESULT_TIMEOUT 124 // like timeout(1)
+#define RESULT_ILLEGAL 132 // 128 + SIGILL
+#define RESULT_FAULT 139 // 128 + SIGSEGV
+
+int run_result = 0;
+uint32_t run_stop_pc;
+uint64_t run_max_instructions = 0;
+uint64_t run_deadline_ns = 0;
+uint64_t run_timeout_ns = 0; // --timeout, the deadline is re-armed from it for every fuzz input
+
+
+void run_stop(int result) // execute() returns result at its next event check, instead of taking the host down
+{
+  if (!run_result)
+  {
+    run_result = result;
+    run_stop_pc = cpu.pc;
+  }
+
+  schedule_event(0);
+}
+
+
+int illegal_instruction(void) // execute()'s result for an instruction it cannot run, unless a fault (e.g. of the fetch) came first
+{
+  run_stop(RESULT_ILLEGAL);
+  return run_result;
+}
+
 
 uint8_t mem_read_8(uint32_t addr)
 {
+  if (addr < code_mem_ptr)
+  {
+    if (!silent)
+      printf("mem_read_8: addr = 0x%"PRIx32", val = %"PRIu32"\n", addr, code_mem[addr]);
+    return code_mem[addr];
+  }
+
   for (uint32_t i = 0; i < mem_ptr; i++)
   {
     if (mem_index[i] == addr)
@@ -35,13 +109,21 @@ uint8_t mem_read_8(uint32_t addr)
   }
 
   fprintf(stderr, "!!! mem_read_8: no mem block found for addr 0x%"PRIx32"! aka. 'segmentation' violation\n", addr);
-  abort();
-  //return 0xFF;
+  run_stop(RESULT_FAULT);
+  return 0xFF;
 }
 
 
 uint16_t mem_read_16(uint32_t addr)
 {
+  if (addr < code_mem_ptr && code_mem_ptr - addr >= 2)
+  {
+    uint16_t val = code_mem[addr] | code_mem[addr+1] << 8;
+    if (!silent)
+      printf("mem_read_16: addr = 0x%"PRIx32", val = %"PRIu16" (%02"PRIx8" %02"PRIx8")\n", addr, val, code_mem[addr], code_mem[addr+1]);
+    return val;
+  }
+
   for (uint32_t i = 0; i < mem_ptr; i++)
   {
     if (mem_index[i] != addr)
@@ -50,8 +132,8 @@ uint16_t mem_read_16(uint32_t addr)
     if ((i + 1) > mem_ptr)
     {
       fprintf(stderr, "!!! mem_read_16: tried reading past mem_ptr\n");
-      abort();
-      //return 0xFFFF;
+      run_stop(RESULT_FAULT);
+      return 0xFFFF;
     }
 
     uint16_t val = mem_block[i] | mem_block[i+1] << 8;
@@ -61,13 +143,21 @@ uint16_t mem_read_16(uint32_t addr)
   }
 
   fprintf(stderr, "!!! mem_read_16: no mem block found for addr 0x%"PRIx32"! aka. 'segmentation' violation\n", addr);
-  abort();
-  //return 0xFFFF;
+  run_stop(RESULT_FAULT);
+  return 0xFFFF;
 }
 
 
 uint32_t mem_read_32(uint32_t addr)
 {
+  if (addr < code_mem_ptr && code_mem_ptr - addr >= 4) // every instruction fetch
+  {
+    uint32_t val = code_mem[addr] | code_mem[addr+1] << 8 | code_mem[addr+2] << 16 | (uint32_t)code_mem[addr+3] << 24;
+    if (!silent)
+      printf("mem_read_32: addr = 0x%"PRIx32", val = %"PRIu32" (%02"PRIx8" %02"PRIx8" %02"PRIx8" %02"PRIx8")\n", addr, val, code_mem[addr], code_mem[addr+1], code_mem[addr+2], code_mem[addr+3]);
+    return val;
+  }
+
   for (uint32_t i = 0; i < mem_ptr; i++)
   {
     if (mem_index[i] != addr)
@@ -76,8 +166,8 @@ uint32_t mem_read_32(uint32_t addr)
     if ((i + 3) > mem_ptr)
     {
       fprintf(stderr, "!!! mem_read_32: tried reading past mem_ptr\n");
-      abort();
-      //return 0xFFFFFFFF;
+      run_stop(RESULT_FAULT);
+      return 0xFFFFFFFF;
     }
 
     uint32_t val = mem_block[i] | mem_block[i+1] << 8 | mem_block[i+2] << 16 | mem_block[i+3] << 24;
@@ -87,13 +177,15 @@ uint32_t mem_read_32(uint32_t addr)
   }
 
   fprintf(stderr, "!!! mem_read_32: no mem block found for addr 0x%"PRIx32"! aka. 'segmentation' violation\n", addr);
-  abort();
-  //return 0xFFFFFFFF;
+  run_stop(RESULT_FAULT);
+  return 0xFFFFFFFF;
 }
 
 
-uint32_t code_mem_ptr = 0; // initial writes before the program was written are allowed to write everything
-uint8_t abort_next = 0;
+uint8_t mem_range_in_code(uint32_t addr, uint32_t len) // [addr, addr + len) overlaps code, also by wrapping around to 0
+{
+  return addr < code_mem_ptr || (len && addr + len - 1 < addr);
+}
 
 
 void mem_write_8(uint32_t addr, uint8_t val)
@@ -101,14 +193,14 @@ void mem_write_8(uint32_t addr, uint8_t val)
   if (addr < code_mem_ptr)
   {
     fprintf(stderr, "!!! tried to write to code address @ 0x%"PRIx32" (mem_ptr = %"PRIx32") \n", addr, code_mem_ptr);
-    //abort();
-    abort_next = 1;
+    run_stop(RESULT_FAULT);
   }
 
   if (mem_ptr >= MAX_MEM_BLOCKS)
   {
     fprintf(stderr, "!!! starved of mem blocks!\n");
-    abort();
+    run_stop(RESULT_FAULT);
+    return;
   }
 
   // if (addr == 9666)
@@ -148,7 +240,8 @@ void mem_write_8_always_add_memblock(uint32_t addr, uint8_t val)
   if (mem_ptr >= MAX_MEM_BLOCKS)
   {
     fprintf(stderr, "!!! starved of mem blocks!\n");
-    abort();
+    run_stop(RESULT_FAULT);
+    return;
   }
 
   mem_index[mem_ptr] = addr;
@@ -162,15 +255,162 @@ void mem_write_8_always_add_memblock(uint32_t addr, uint8_t val)
 }
 
 
+#define MEM_NOT_FOUND 0xFFFFFFFF
+
+
+void mem_slots(uint32_t addr, uint32_t len, uint32_t *slots) // index of the mem block of every byte in [addr, addr + len), in a single pass over all blocks
+{
+  memset(slots, 0xFF, len * sizeof(uint32_t)); // MEM_NOT_FOUND
+
+  for (uint32_t i = mem_ptr; i-- > 0;) // backwards, so the first block for an addr wins like in mem_read_8
+  {
+    uint32_t offset = mem_index[i] - addr;
+    if (offset < len)
+      slots[offset] = i;
+  }
+}
+
+
+void mem_store_range(uint32_t addr, const uint8_t *src, uint8_t fill, uint32_t len) // copies src (or fills with fill if src is NULL), no code protection, no trace
+{
+  if (len > MAX_MEM_BLOCKS)
+  {
+    fprintf(stderr, "!!! starved of mem blocks!\n");
+    run_stop(RESULT_FAULT);
+    return;
+  }
+
+  uint32_t small[8];
+  uint32_t *slots = len <= 8 ? small : malloc(len * sizeof(uint32_t));
+  mem_slots(addr, len, slots);
+
+  uint32_t missing = 0;
+  for (uint32_t k = 0; k < len; k++)
+    missing += slots[k] == MEM_NOT_FOUND;
+
+  if (mem_ptr + missing > MAX_MEM_BLOCKS)
+  {
+    fprintf(stderr, "!!! starved of mem blocks!\n");
+    run_stop(RESULT_FAULT);
+    if (slots != small)
+      free(slots);
+    return;
+  }
+
+  for (uint32_t k = 0; k < len;) // one host memcpy / memset per run of consecutive blocks
+  {
+    uint32_t run = 1;
+    uint8_t *dest;
+
+    if (slots[k] == MEM_NOT_FOUND) // new blocks are added consecutively, so later accesses find them as one run
+    {
+      while (k + run < len && slots[k + run] == MEM_NOT_FOUND)
+        run++;
+
+      for (uint32_t j = 0; j < run; j++)
+        mem_index[mem_ptr + j] = addr + k + j;
+
+      dest = &mem_block[mem_ptr];
+      mem_ptr += run;
+    }
+    else
+    {
+      while (k + run < len && slots[k + run] == slots[k] + run)
+        run++;
+
+      dest = &mem_block[slots[k]];
+    }
+
+    if (src)
+      memcpy(dest, src + k, run);
+    else
+      memset(dest, fill, run);
+
+    k += run;
+  }
+
+  if (slots != small)
+    free(slots);
+}
+
+
+int mem_load_range(uint32_t addr, uint8_t *dst, uint32_t len) // returns -1 if a byte has no mem block (or isn't code)
+{
+  if (len > MAX_MEM_BLOCKS)
+    return -1;
+
+  uint32_t small[8];
+  uint32_t *slots = len <= 8 ? small : malloc(len * sizeof(uint32_t));
+  mem_slots(addr, len, slots);
+
+  int ret = 0;
+  for (uint32_t k = 0; k < len;)
+  {
+    uint32_t run = 1;
+
+    if (addr + k < code_mem_ptr)
+    {
+      while (k + run < len && addr + k + run < code_mem_ptr)
+        run++;
+
+      memcpy(dst + k, &code_mem[addr + k], run);
+      k += run;
+      continue;
+    }
+
+    if (slots[k] == MEM_NOT_FOUND)
+    {
+      ret = -1;
+      break;
+    }
+
+    while (k + run < len && slots[k + run] == slots[k] + run)
+      run++;
+
+    memcpy(dst + k, &mem_block[slots[k]], run);
+    k += run;
+  }
+
+  if (slots != small)
+    free(slots);
+  return ret;
+}
+
+
+void mem_write_range(uint32_t addr, const uint8_t *src, uint8_t fill, uint32_t len) // mem_write_8 for many bytes, code protection checked once
+{
+  if (mem_range_in_code(addr, len))
+  {
+    fprintf(stderr, "!!! tried to write to code address @ 0x%"PRIx32" (mem_ptr = %"PRIx32") \n", addr, code_mem_ptr);
+    run_stop(RESULT_FAULT);
+    return;
+  }
+
+  mem_store_range(addr, src, fill, len);
+}
+
+
+void mem_copy(uint32_t dst, uint32_t src, uint32_t len) // memmove semantics
+{
+  uint8_t *tmp = malloc(len ? len : 1);
+
+  if (mem_load_range(src, tmp, len) < 0)
+  {
+    fprintf(stderr, "!!! mem_copy: no mem block found in 0x%"PRIx32" - 0x%"PRIx32"! aka. 'segmentation' violation\n", src, src + len);
+    run_stop(RESULT_FAULT);
+    free(tmp);
+    return;
+  }
+
+  mem_write_range(dst, tmp, 0, len);
+  free(tmp);
+}
+
+
 void mem_write_32(uint32_t addr, uint32_t val)
 {
-  int old_silence = silent;
-  silent = 1;
-  mem_write_8(addr, val);
-  mem_write_8(addr+1, val >> 8); // TODO: skip bits or ... ?
-  mem_write_8(addr+2, val >> 16);
-  mem_write_8(addr+3, val >> 24);
-  silent = old_silence;
+  uint8_t bytes[4] = { val, val >> 8, val >> 16, val >> 24 };
+  mem_write_range(addr, bytes, 0, 4); // one pass over the mem blocks instead of four mem_write_8's
 
   if (silent)
     return;
@@ -178,6 +418,58 @@ void mem_write_32(uint32_t addr, uint32_t val)
 }
 
 
+uint32_t mem_lookup(uint32_t addr) // index of the mem block for addr, or MEM_NOT_FOUND; code has no mem blocks
+{
+  for (uint32_t i = 0; i < mem_ptr; i++)
+  {
+    if (mem_index[i] == addr)
+      return i;
+  }
+
+  return MEM_NOT_FOUND;
+}
+
+
+int mem_peek_8(uint32_t addr, uint8_t *val) // like mem_read_8, but never traces or faults, returns -1 if addr has no memory
+{
+  if (addr < code_mem_ptr)
+  {
+    *val = code_mem[addr];
+    return 0;
+  }
+
+  uint32_t i = mem_lookup(addr);
+  if (i == MEM_NOT_FOUND)
+    return -1;
+
+  *val = mem_block[i];
+  return 0;
+}
+
+
+void mem_poke_8(uint32_t addr, uint8_t val) // like mem_write_8, but may write to code (debugger, breakpoints) and never traces
+{
+  if (addr < code_mem_ptr) // copies the page on the first write, other instances keep the file's
+  {
+    code_mem[addr] = val;
+    return;
+  }
+
+  uint32_t i = mem_lookup(addr);
+
+  if (i != MEM_NOT_FOUND)
+  {
+    mem_block[i] = val;
+    return;
+  }
+
+  int old_silence = silent;
+  silent = 1;
+  mem_write_8_always_add_memblock(addr, val);
+  silent = old_silence;
+}
+
+
 // void meminit(void *adr, int size)
 // {
 //   for (int i = 0; i < size; i++)
@@ -185,141 +477,2600 @@ void mem_write_32(uint32_t addr, uint32_t val)
 // }
 
 
-const char *_r2s[] = { "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a7", "s2" };
+const char *_r2s[] = { "zero", "ra", "sp", "gp", "tp", "t0", "t1", "t2", "s0", "s1", "a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7",
+  "s2", "s3", "s4", "s5", "s6", "s7", "s8", "s9", "s10", "s11", "t3", "t4", "t5", "t6" };
 
 
 const char *r2s(uint8_t reg) // register to string
 {
-  if (reg > 14)
+  if (reg > 31)
   {
-    abort_next = 1;
     fprintf(stderr, "!!! r2s: unknown register %"PRIu8"\n", reg);
     return "???";
   }
   return _r2s[reg];
 }
 
+// trace triggers: every configured one is a gate, an instruction is traced only while all of them are open
+#define TRACE_GATE_WINDOW 1
+#define TRACE_GATE_PC 2
+#define TRACE_GATE_STORE 4
+#define TRACE_GATE_SAMPLE 8
 
-uint32_t stop_after_instructions = 50;
-uint32_t inst_count;
+uint8_t trace_closed = 0; // gates currently closed
 
 
-int main(int argc, char **argv)
+void trace_gate(uint8_t gate, uint8_t open) // the only place triggers change silent
+{
+  if (open)
+    trace_closed &= ~gate;
+  else
+    trace_closed |= gate;
+
+  silent = trace_closed != 0;
+}
+
+
+// breakpoints are patched into guest memory as EBREAK, so execute() only notices them when one is actually hit
+#define INST_EBREAK 0b00000000000100000000000001110011
+#define MAX_BREAKPOINTS 64
+#define MAX_WATCHPOINTS 16
+
+// who set a breakpoint, it stays patched in until all owners removed it
+#define BP_GDB 1
+#define BP_TRACE_ON 2
+#define BP_TRACE_OFF 4
+
+typedef struct
+{
+  uint32_t addr;
+  uint32_t orig; // original instruction at addr
+  uint8_t owners;
+} breakpoint_t;
+
+typedef struct
+{
+  uint32_t addr;
+  uint32_t len;
+  uint8_t type; // 2 = write, 3 = read, 4 = access (as in the Z packet)
+  uint8_t trace; // trace trigger instead of a gdb watchpoint
+} watchpoint_t;
+
+breakpoint_t breakpoints[MAX_BREAKPOINTS];
+uint32_t breakpoint_count = 0;
+
+watchpoint_t watchpoints[MAX_WATCHPOINTS]; // checked in the load / store paths while watchpoint_count != 0
+uint32_t watchpoint_count = 0;
+
+
+breakpoint_t *breakpoint_find(uint32_t addr)
 {
-  if (argc != 2)
+  for (uint32_t i = 0; i < breakpoint_count; i++)
   {
-    fprintf(stderr, "usage: %s <binary file>\n", argv[0]);
+    if (breakpoints[i].addr == addr)
+      return &breakpoints[i];
+  }
+
+  return NULL;
+}
+
+
+int breakpoint_insert(uint32_t addr, uint8_t owner)
+{
+  breakpoint_t *bp = breakpoint_find(addr);
+  if (bp)
+  {
+    bp->owners |= owner;
+    return 0;
+  }
+
+  if (breakpoint_count >= MAX_BREAKPOINTS)
     return -1;
+
+  uint32_t orig = 0;
+  for (uint32_t i = 0; i < 4; i++)
+  {
+    uint8_t byte;
+    if (mem_peek_8(addr + i, &byte) < 0)
+      return -1;
+    orig |= (uint32_t)byte << (i * 8);
   }
-  fprintf(stderr, "binary file: %s\n", argv[1]);
 
-  cpu_t cpu;
-  //meminit(cpu, sizeof(cpu));
-  uint32_t cpu_size = sizeof(cpu_t);
-  memset(&cpu, 0, cpu_size);
+  breakpoints[breakpoint_count].addr = addr;
+  breakpoints[breakpoint_count].orig = orig;
+  breakpoints[breakpoint_count].owners = owner;
+  breakpoint_count++;
 
+  for (uint32_t i = 0; i < 4; i++)
+    mem_poke_8(addr + i, INST_EBREAK >> (i * 8));
 
-  //printf("cpu size = %"PRIu32"\n", cpu_size);
+  return 0;
+}
 
-  FILE *f = fopen(argv[1], "r");
 
-  if (!f)
+int breakpoint_remove(uint32_t addr, uint8_t owner)
+{
+  breakpoint_t *bp = breakpoint_find(addr);
+  if (!bp || !(bp->owners & owner))
     return -1;
 
+  bp->owners &= ~owner;
+  if (bp->owners)
+    return 0;
 
-  fseek(f, 0L, SEEK_END);
-  size_t file_size = ftell(f);
-  rewind(f);
+  for (uint32_t i = 0; i < 4; i++)
+    mem_poke_8(addr + i, bp->orig >> (i * 8));
 
+  *bp = breakpoints[--breakpoint_count];
+  return 0;
+}
 
-  uint8_t *binary = (uint8_t *)malloc(file_size);
 
-  printf("reading %zu bytes from binary...\n", file_size);
+// ---- F extension, computed on the host fpu ----
 
-  int x = fread(binary, 1, file_size, f);
+#define FFLAG_NX 1 // inexact
+#define FFLAG_UF 2 // underflow
+#define FFLAG_OF 4 // overflow
+#define FFLAG_DZ 8 // divide by zero
+#define FFLAG_NV 16 // invalid
+#define F_CANONICAL_NAN 0x7FC00000
 
-  printf("read %d bytes from binary\n", x);
+#define CSR_FFLAGS 0x001
+#define CSR_FRM 0x002
+#define CSR_FCSR 0x003
+#define CSR_CYCLE 0xC00 // user counters, read-only, their high halves at + 0x80
+#define CSR_TIME 0xC01
+#define CSR_INSTRET 0xC02
+#define CSR_CYCLEH 0xC80
+#define CSR_TIMEH 0xC81
+#define CSR_INSTRETH 0xC82
 
-  puts("injecting binary...");
+// rounding modes RNE, RTZ, RDN, RUP, RMM; the host has no RMM, it rounds to nearest even instead
+const int fp_host_rm[] = { FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST };
 
-  silent = 1;
-  for (uint32_t i = 0; i < x; i++)
-    mem_write_8_always_add_memblock(i, binary[i]);
+const char *_f2s[] = { "ft0", "ft1", "ft2", "ft3", "ft4", "ft5", "ft6", "ft7", "fs0", "fs1", "fa0", "fa1", "fa2", "fa3", "fa4", "fa5", "fa6", "fa7",
+  "fs2", "fs3", "fs4", "fs5", "fs6", "fs7", "fs8", "fs9", "fs10", "fs11", "ft8", "ft9", "ft10", "ft11" };
 
-  puts("injecting binary done");
 
-  free(binary);
-  
-  // for (uint32_t i = 0; i < x; i+=4)
-  //   printf("0x%02"PRIx32" = %02"PRIx8" %02"PRIx8" %02"PRIx8" %02"PRIx8"\n", i, mem_read_8(i), mem_read_8(i+1), mem_read_8(i+2), mem_read_8(i+3));
-  silent = 0;
+const char *f2s(uint8_t reg) // float register to string
+{
+  return _f2s[reg & 31];
+}
 
 
-  code_mem_ptr = mem_ptr;
+float f32(uint32_t bits)
+{
+  float f;
+  memcpy(&f, &bits, 4);
+  return f;
+}
 
-  //printf("mem_ptr now %"PRIu32"\n", mem_ptr);
 
-  
-  // go :) - NOTE: must be platform independent at this point:
-  cpu.pc = 0;
-  //cpu.regs[2] = 0x10000; // set stack pointer to some smaller value than 0-1 ;)
-  mem_write_8_always_add_memblock(cpu.regs[2], 0); // = return address, which is known and is 0x0  (tell our software memory system to know the stack!)
+uint32_t f32_bits(float f) // results of arithmetic, NaNs become the canonical NaN
+{
+  if (f != f)
+    return F_CANONICAL_NAN;
 
+  uint32_t bits;
+  memcpy(&bits, &f, 4);
+  return bits;
+}
 
-  puts("executing!");
 
+uint8_t f32_is_nan(uint32_t bits)
+{
+  return (bits & 0x7FFFFFFF) > 0x7F800000;
+}
 
-  while (1)
-  {
-    if (abort_next)
-    {
-      fprintf(stderr, "aborting due to previous error!\n");
-      abort();
-    }
 
-    // if (inst_count > stop_after_instructions)
-    // {
-    //   printf("# reached stop_after_instructions\n");
-    //   break;
-    // }
+uint8_t f32_is_snan(uint32_t bits)
+{
+  return f32_is_nan(bits) && !(bits & 0x00400000);
+}
 
-    inst_count++;
 
-    cpu.regs[0] = 0;
-    //printf("reading instruction... ");
+double f32_trace(uint32_t bits) // for printing: converting a signalling NaN to double would raise the host's invalid flag
+{
+  return f32_is_nan(bits) ? NAN : f32(bits);
+}
 
-    silent = 1;
-    const uint32_t inst = mem_read_32(cpu.pc);
-    silent = 0;
 
+// the host's exception flags are sticky like fflags, so they are left to accumulate during
+// arithmetic and only folded into fcsr when the guest reads it
+uint32_t fp_fflags(void)
+{
+  int host = fetestexcept(FE_ALL_EXCEPT);
 
-#define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c" // thx to William Whyte on stackoverflow
-#define BYTE_TO_BINARY(byte)  \
-  (byte & 0x80 ? '1' : '0'), \
-  (byte & 0x40 ? '1' : '0'), \
-  (byte & 0x20 ? '1' : '0'), \
-  (byte & 0x10 ? '1' : '0'), \
-  (byte & 0x08 ? '1' : '0'), \
-  (byte & 0x04 ? '1' : '0'), \
-  (byte & 0x02 ? '1' : '0'), \
-  (byte & 0x01 ? '1' : '0') 
+  if (host)
+  {
+    cpu.fcsr |= (host & FE_INEXACT ? FFLAG_NX : 0) | (host & FE_UNDERFLOW ? FFLAG_UF : 0) | (host & FE_OVERFLOW ? FFLAG_OF : 0)
+      | (host & FE_DIVBYZERO ? FFLAG_DZ : 0) | (host & FE_INVALID ? FFLAG_NV : 0);
+    feclearexcept(FE_ALL_EXCEPT);
+  }
 
+  return cpu.fcsr & 0x1F;
+}
 
-    printf("\n[PC = 0x%"PRIx32", inst = %02"PRIx8" %02"PRIx8" %02"PRIx8" %02"PRIx8" ("BYTE_TO_BINARY_PATTERN""BYTE_TO_BINARY_PATTERN""BYTE_TO_BINARY_PATTERN""BYTE_TO_BINARY_PATTERN")] MWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMW\n", 
-    cpu.pc, (uint8_t)inst, (uint8_t)(inst >> 8), (uint8_t)(inst >> 16),(uint8_t)(inst >> 24), BYTE_TO_BINARY((uint8_t)inst>>24), BYTE_TO_BINARY(inst>>16), BYTE_TO_BINARY(inst>>8), BYTE_TO_BINARY(inst));
-        
 
+int fp_rm(uint8_t funct3) // effective rounding mode of an instruction, -1 if reserved
+{
+  uint8_t rm = funct3 == 0b111 ? (cpu.fcsr >> 5) & 0b111 : funct3; // DYN
+  return rm > 4 ? -1 : rm;
+}
 
-    uint8_t opcode = inst & 0x7F;
 
-    uint8_t funct3 = (inst >> 12) & 0b111;
-    uint8_t funct7 = (inst >> 25) & 0b1111111;
+// defined with the counters after the timing model, gdb needs them before that
+int csr_read(uint16_t csr, uint32_t *val, uint8_t in_instruction);
+int csr_write(uint16_t csr, uint32_t val);
 
 
-    switch (inst)
-    {
-      // case 0b00000000001000000000000001110011: // uret (wtf)
-      // case 0b00010000001000000000000001110011: // sret (wtf)
+int32_t fp_to_int(uint32_t bits, int rm, uint8_t is_unsigned) // FCVT.W[U].S, saturating like the spec wants, flags set here
+{
+  float a = f32(bits);
+  float r;
+
+  switch (rm)
+  {
+    case 1: r = truncf(a); break;
+    case 2: r = floorf(a); break;
+    case 3: r = ceilf(a); break;
+    case 4: r = roundf(a); break;
+    default: r = nearbyintf(a); break; // host is in round to nearest even here
+  }
+
+  if (f32_is_nan(bits))
+  {
+    cpu.fcsr |= FFLAG_NV;
+    return is_unsigned ? (int32_t)UINT32_MAX : INT32_MAX;
+  }
+
+  if (is_unsigned ? r >= 4294967296.0f : r >= 2147483648.0f)
+  {
+    cpu.fcsr |= FFLAG_NV;
+    return is_unsigned ? (int32_t)UINT32_MAX : INT32_MAX;
+  }
+
+  if (is_unsigned ? r < 0.0f : r < -2147483648.0f)
+  {
+    cpu.fcsr |= FFLAG_NV;
+    return is_unsigned ? 0 : INT32_MIN;
+  }
+
+  if (r != a)
+    cpu.fcsr |= FFLAG_NX;
+
+  return is_unsigned ? (int32_t)(uint32_t)r : (int32_t)r;
+}
+
+
+uint32_t fp_class(uint32_t bits) // FCLASS.S
+{
+  uint32_t sign = bits >> 31;
+  uint32_t exp = (bits >> 23) & 0xFF;
+  uint32_t man = bits & 0x7FFFFF;
+
+  if (exp == 0xFF)
+    return man ? (man & 0x400000 ? 1 << 9 : 1 << 8) : (sign ? 1 << 0 : 1 << 7);
+  if (exp == 0)
+    return man ? (sign ? 1 << 2 : 1 << 5) : (sign ? 1 << 3 : 1 << 4);
+  return sign ? 1 << 1 : 1 << 6;
+}
+
+
+int fp_op(uint32_t inst) // OP-FP, returns -1 for an illegal instruction
+{
+  uint8_t rd = (inst >> 7) & 0b11111;
+  uint8_t rs1 = (inst >> 15) & 0b11111;
+  uint8_t rs2 = (inst >> 20) & 0b11111;
+  uint8_t funct3 = (inst >> 12) & 0b111;
+  uint8_t funct7 = (inst >> 25) & 0b1111111;
+
+  uint32_t ua = cpu.fregs[rs1];
+  uint32_t ub = cpu.fregs[rs2];
+  float a = f32(ua);
+  float b = f32(ub);
+
+  switch (funct7)
+  {
+    case 0b0000000: // FADD.S
+    case 0b0000100: // FSUB.S
+    case 0b0001000: // FMUL.S
+    case 0b0001100: // FDIV.S
+    case 0b0101100: // FSQRT.S
+    {
+      int rm = fp_rm(funct3);
+      if (rm < 0 || (funct7 == 0b0101100 && rs2 != 0))
+        return -1;
+
+      if (rm) // round to nearest even is the host's mode already
+        fesetround(fp_host_rm[rm]);
+
+      float r;
+      const char *name;
+      switch (funct7)
+      {
+        case 0b0000000: r = a + b; name = "FADD.S"; break;
+        case 0b0000100: r = a - b; name = "FSUB.S"; break;
+        case 0b0001000: r = a * b; name = "FMUL.S"; break;
+        case 0b0001100: r = a / b; name = "FDIV.S"; break;
+        default: r = sqrtf(a); name = "FSQRT.S"; break;
+      }
+
+      if (rm)
+        fesetround(FE_TONEAREST);
+
+      cpu.fregs[rd] = f32_bits(r);
+
+      if (!silent)
+        printf("OP: %s: rd = %s, rs1 = %s, rs2 = %s, f[rs1] = %g, f[rs2] = %g, f[rd] = %g (0x%08"PRIx32"), rm = %d\n", name, f2s(rd), f2s(rs1), f2s(rs2), f32_trace(ua), f32_trace(ub), f32_trace(cpu.fregs[rd]), cpu.fregs[rd], rm);
+      return 0;
+    }
+
+    case 0b0010000: // FSGNJ.S, FSGNJN.S, FSGNJX.S
+    {
+      uint32_t sign;
+      if (funct3 == 0b000)
+        sign = ub;
+      else if (funct3 == 0b001)
+        sign = ~ub;
+      else if (funct3 == 0b010)
+        sign = ua ^ ub;
+      else
+        return -1;
+
+      cpu.fregs[rd] = (ua & 0x7FFFFFFF) | (sign & 0x80000000);
+
+      if (!silent)
+        printf("OP: FSGNJ(N/X).S: rd = %s, rs1 = %s, rs2 = %s, f[rd] = %g (0x%08"PRIx32")\n", f2s(rd), f2s(rs1), f2s(rs2), f32_trace(cpu.fregs[rd]), cpu.fregs[rd]);
+      return 0;
+    }
+
+    case 0b0010100: // FMIN.S, FMAX.S
+    {
+      if (funct3 > 0b001)
+        return -1;
+
+      if (f32_is_snan(ua) || f32_is_snan(ub))
+        cpu.fcsr |= FFLAG_NV;
+
+      if (f32_is_nan(ua) && f32_is_nan(ub))
+        cpu.fregs[rd] = F_CANONICAL_NAN;
+      else if (f32_is_nan(ua))
+        cpu.fregs[rd] = ub;
+      else if (f32_is_nan(ub))
+        cpu.fregs[rd] = ua;
+      else if (a == b) // only differ for +0 / -0: min prefers -0, max +0
+        cpu.fregs[rd] = funct3 == 0b000 ? ua | ub : ua & ub;
+      else
+        cpu.fregs[rd] = (a < b) == (funct3 == 0b000) ? ua : ub;
+
+      if (!silent)
+        printf("OP: %s: rd = %s, rs1 = %s, rs2 = %s, f[rd] = %g\n", funct3 ? "FMAX.S" : "FMIN.S", f2s(rd), f2s(rs1), f2s(rs2), f32_trace(cpu.fregs[rd]));
+      return 0;
+    }
+
+    case 0b1010000: // FEQ.S, FLT.S, FLE.S
+    {
+      if (funct3 > 0b010)
+        return -1;
+
+      uint32_t result = 0;
+      if (f32_is_nan(ua) || f32_is_nan(ub))
+      {
+        if (funct3 != 0b010 || f32_is_snan(ua) || f32_is_snan(ub)) // FLT and FLE are signaling, FEQ only for signaling NaNs
+          cpu.fcsr |= FFLAG_NV;
+      }
+      else if (funct3 == 0b010)
+        result = a == b;
+      else if (funct3 == 0b001)
+        result = a < b;
+      else
+        result = a <= b;
+
+      cpu.regs[rd] = result;
+
+      if (!silent)
+        printf("OP: %s: rd = %s, rs1 = %s, rs2 = %s, f[rs1] = %g, f[rs2] = %g, x[rd] = %"PRIu32"\n", funct3 == 0b010 ? "FEQ.S" : (funct3 ? "FLT.S" : "FLE.S"), r2s(rd), f2s(rs1), f2s(rs2), f32_trace(ua), f32_trace(ub), result);
+      return 0;
+    }
+
+    case 0b1100000: // FCVT.W.S, FCVT.WU.S
+    {
+      int rm = fp_rm(funct3);
+      if (rm < 0 || rs2 > 1)
+        return -1;
+
+      cpu.regs[rd] = fp_to_int(ua, rm, rs2);
+
+      if (!silent)
+        printf("OP: %s: rd = %s, rs1 = %s, f[rs1] = %g, x[rd] = %"PRIi32"\n", rs2 ? "FCVT.WU.S" : "FCVT.W.S", r2s(rd), f2s(rs1), f32_trace(ua), cpu.regs[rd]);
+      return 0;
+    }
+
+    case 0b1101000: // FCVT.S.W, FCVT.S.WU
+    {
+      int rm = fp_rm(funct3);
+      if (rm < 0 || rs2 > 1)
+        return -1;
+
+      if (rm)
+        fesetround(fp_host_rm[rm]);
+
+      float r = rs2 ? (float)cpu.regs[rs1] : (float)(int32_t)cpu.regs[rs1];
+
+      if (rm)
+        fesetround(FE_TONEAREST);
+
+      cpu.fregs[rd] = f32_bits(r);
+
+      if (!silent)
+        printf("OP: %s: rd = %s, rs1 = %s, x[rs1] = %"PRIu32", f[rd] = %g\n", rs2 ? "FCVT.S.WU" : "FCVT.S.W", f2s(rd), r2s(rs1), cpu.regs[rs1], r);
+      return 0;
+    }
+
+    case 0b1110000: // FMV.X.W, FCLASS.S
+    {
+      if (rs2 != 0 || funct3 > 0b001)
+        return -1;
+
+      cpu.regs[rd] = funct3 ? fp_class(ua) : ua;
+
+      if (!silent)
+        printf("OP: %s: rd = %s, rs1 = %s, x[rd] = 0x%"PRIx32"\n", funct3 ? "FCLASS.S" : "FMV.X.W", r2s(rd), f2s(rs1), cpu.regs[rd]);
+      return 0;
+    }
+
+    case 0b1111000: // FMV.W.X
+    {
+      if (rs2 != 0 || funct3 != 0b000)
+        return -1;
+
+      cpu.fregs[rd] = cpu.regs[rs1];
+
+      if (!silent)
+        printf("OP: FMV.W.X: rd = %s, rs1 = %s, f[rd] = %g (0x%08"PRIx32")\n", f2s(rd), r2s(rs1), f32_trace(cpu.fregs[rd]), cpu.fregs[rd]);
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+
+int fp_fma(uint32_t inst) // FMADD.S, FMSUB.S, FNMSUB.S, FNMADD.S, returns -1 for an illegal instruction
+{
+  uint8_t opcode = inst & 0x7F;
+  uint8_t rd = (inst >> 7) & 0b11111;
+  uint8_t rs1 = (inst >> 15) & 0b11111;
+  uint8_t rs2 = (inst >> 20) & 0b11111;
+  uint8_t rs3 = (inst >> 27) & 0b11111;
+  int rm = fp_rm((inst >> 12) & 0b111);
+
+  if (rm < 0 || ((inst >> 25) & 0b11) != 0) // fmt must be S
+    return -1;
+
+  float a = f32(cpu.fregs[rs1]);
+  float b = f32(cpu.fregs[rs2]);
+  float c = f32(cpu.fregs[rs3]);
+
+  if (rm)
+    fesetround(fp_host_rm[rm]);
+
+  float r;
+  const char *name;
+  switch (opcode)
+  {
+    case 0b1000011: r = fmaf(a, b, c); name = "FMADD.S"; break;
+    case 0b1000111: r = fmaf(a, b, -c); name = "FMSUB.S"; break;
+    case 0b1001011: r = fmaf(-a, b, c); name = "FNMSUB.S"; break;
+    default: r = fmaf(-a, b, -c); name = "FNMADD.S"; break;
+  }
+
+  if (rm)
+    fesetround(FE_TONEAREST);
+
+  cpu.fregs[rd] = f32_bits(r);
+
+  if (!silent)
+    printf("OP: %s: rd = %s, rs1 = %s, rs2 = %s, rs3 = %s, f[rd] = %g (0x%08"PRIx32"), rm = %d\n", name, f2s(rd), f2s(rs1), f2s(rs2), f2s(rs3), f32_trace(cpu.fregs[rd]), cpu.fregs[rd], rm);
+  return 0;
+}
+
+
+// ---- gdb remote serial protocol stub ----
+
+#define GDB_PACKET_SIZE 4096
+#define GDB_XML_SIZE 8192
+#define GDB_POLL_INTERVAL 65536 // instructions between checks for a ctrl-c from gdb
+
+int gdb_fd = -1;
+uint8_t gdb_stepping = 0;
+uint8_t gdb_step_over_bp = 0; // resumed on a breakpoint, execute its original instruction once
+char gdb_pending_stop[64]; // stop reply to send at the next handle_events()
+char gdb_last_stop[64];
+char gdb_target_xml[GDB_XML_SIZE];
+
+uint8_t gdb_rx_buf[GDB_PACKET_SIZE];
+size_t gdb_rx_len = 0;
+size_t gdb_rx_pos = 0;
+
+
+int gdb_getc(void)
+{
+  if (gdb_rx_pos == gdb_rx_len)
+  {
+    ssize_t n = recv(gdb_fd, gdb_rx_buf, sizeof(gdb_rx_buf), 0);
+    if (n <= 0)
+      return -1;
+
+    gdb_rx_len = n;
+    gdb_rx_pos = 0;
+  }
+
+  return gdb_rx_buf[gdb_rx_pos++];
+}
+
+
+void gdb_send_packet(const char *data)
+{
+  char out[GDB_PACKET_SIZE + 8];
+  uint8_t csum = 0;
+
+  for (const char *c = data; *c; c++)
+    csum += (uint8_t)*c;
+
+  int len = snprintf(out, sizeof(out), "$%s#%02x", data, csum);
+
+  while (1)
+  {
+    if (send(gdb_fd, out, len, 0) != len)
+      return;
+
+    int ack = gdb_getc();
+    if (ack != '-') // '+' or connection gone
+      return;
+  }
+}
+
+
+int gdb_recv_packet(char *buf)
+{
+  while (1)
+  {
+    int c;
+    do // skip acks and ctrl-c's that arrive while stopped
+    {
+      c = gdb_getc();
+      if (c < 0)
+        return -1;
+    } while (c != '$');
+
+    size_t len = 0;
+    uint8_t csum = 0;
+    while ((c = gdb_getc()) >= 0 && c != '#')
+    {
+      if (len < GDB_PACKET_SIZE - 1)
+        buf[len++] = c;
+      csum += c;
+    }
+
+    int hi = gdb_getc();
+    int lo = gdb_getc();
+    if (c < 0 || hi < 0 || lo < 0)
+      return -1;
+
+    char hex[3] = { hi, lo, 0 };
+    if (strtoul(hex, NULL, 16) != csum)
+    {
+      send(gdb_fd, "-", 1, 0);
+      continue;
+    }
+
+    send(gdb_fd, "+", 1, 0);
+    buf[len] = 0;
+    return len;
+  }
+}
+
+
+uint32_t gdb_parse_hex(const char **p)
+{
+  char *end;
+  uint32_t val = strtoul(*p, &end, 16);
+  *p = end;
+  return val;
+}
+
+
+void gdb_put_reg(char *out, uint32_t val) // 8 hex digits, target (little endian) byte order
+{
+  sprintf(out, "%02"PRIx8"%02"PRIx8"%02"PRIx8"%02"PRIx8, (uint8_t)val, (uint8_t)(val >> 8), (uint8_t)(val >> 16), (uint8_t)(val >> 24));
+}
+
+
+uint32_t gdb_get_reg(const char **p)
+{
+  char hex[9] = { 0 };
+  strncpy(hex, *p, 8);
+  *p += strlen(hex);
+
+  uint32_t val = strtoul(hex, NULL, 16);
+  return (val >> 24) | ((val >> 8) & 0xFF00) | ((val << 8) & 0xFF0000) | (val << 24);
+}
+
+
+// gdb register numbers: x0-x31, pc, f0-f31, then csrs at 65 + their number
+#define GDB_REG_F0 33
+#define GDB_REG_CSR0 65
+
+
+int gdb_read_reg(uint32_t n, uint32_t *val) // -1 if there is no such register
+{
+  if (n < 32)
+    *val = cpu.regs[n];
+  else if (n == 32)
+    *val = cpu.pc;
+  else if (n < GDB_REG_CSR0)
+    *val = cpu.fregs[n - GDB_REG_F0];
+  else if (n - GDB_REG_CSR0 == CSR_TIME || n - GDB_REG_CSR0 == CSR_TIMEH) // would end up in a recording as guest input
+    return -1;
+  else
+    return n - GDB_REG_CSR0 <= 0xFFF ? csr_read(n - GDB_REG_CSR0, val, 0) : -1;
+  return 0;
+}
+
+
+int gdb_write_reg(uint32_t n, uint32_t val) // -1 if there is no such register
+{
+  if (n < 32)
+    cpu.regs[n] = val;
+  else if (n == 32)
+    cpu.pc = val;
+  else if (n < GDB_REG_CSR0)
+    cpu.fregs[n - GDB_REG_F0] = val;
+  else
+    return n - GDB_REG_CSR0 <= 0xFFF ? csr_write(n - GDB_REG_CSR0, val) : -1;
+  return 0;
+}
+
+
+int gdb_read_byte(uint32_t addr, uint8_t *val) // reads memory as it was before breakpoints were patched in
+{
+  for (uint32_t i = 0; i < breakpoint_count; i++)
+  {
+    if (addr - breakpoints[i].addr < 4)
+    {
+      *val = breakpoints[i].orig >> ((addr - breakpoints[i].addr) * 8);
+      return 0;
+    }
+  }
+
+  return mem_peek_8(addr, val);
+}
+
+
+void gdb_write_byte(uint32_t addr, uint8_t val)
+{
+  for (uint32_t i = 0; i < breakpoint_count; i++)
+  {
+    if (addr - breakpoints[i].addr < 4) // keep the breakpoint, but restore the new value on removal
+    {
+      uint32_t shift = (addr - breakpoints[i].addr) * 8;
+      breakpoints[i].orig = (breakpoints[i].orig & ~(0xFFu << shift)) | ((uint32_t)val << shift);
+      return;
+    }
+  }
+
+  mem_poke_8(addr, val);
+}
+
+
+void watch_check(uint32_t addr, uint32_t len, uint8_t is_write) // called from the load / store paths while watchpoints are set
+{
+  for (uint32_t i = 0; i < watchpoint_count; i++)
+  {
+    watchpoint_t *wp = &watchpoints[i];
+
+    if (addr >= wp->addr + wp->len || wp->addr >= addr + len)
+      continue;
+    if ((wp->type == 2 && !is_write) || (wp->type == 3 && is_write))
+      continue;
+
+    if (wp->trace) // one shot trace trigger
+    {
+      trace_gate(TRACE_GATE_STORE, 1);
+      *wp = watchpoints[--watchpoint_count];
+      i--;
+      continue;
+    }
+
+    const char *kind = wp->type == 2 ? "watch" : (wp->type == 3 ? "rwatch" : "awatch");
+    snprintf(gdb_pending_stop, sizeof(gdb_pending_stop), "T05%s:%08"PRIx32";", kind, addr);
+    schedule_event(0);
+    return;
+  }
+}
+
+
+void gdb_detach(void)
+{
+  for (uint32_t i = breakpoint_count; i-- > 0;)
+    breakpoint_remove(breakpoints[i].addr, BP_GDB);
+
+  for (uint32_t i = watchpoint_count; i-- > 0;)
+  {
+    if (!watchpoints[i].trace)
+      watchpoints[i] = watchpoints[--watchpoint_count];
+  }
+
+  gdb_stepping = 0;
+  gdb_step_over_bp = 0;
+  gdb_pending_stop[0] = 0;
+
+  close(gdb_fd);
+  gdb_fd = -1;
+  fprintf(stderr, "gdb detached\n");
+}
+
+
+void gdb_resume(const char *args, uint8_t step)
+{
+  if (*args)
+    cpu.pc = gdb_parse_hex(&args);
+
+  gdb_stepping = step;
+  breakpoint_t *bp = breakpoint_find(cpu.pc);
+  gdb_step_over_bp = bp && (bp->owners & BP_GDB); // trace triggers at pc re-fetch the original instruction themselves
+
+  if (step)
+    schedule_event(inst_count + 1);
+}
+
+
+void gdb_handle_query(char *packet, char *reply)
+{
+  if (!strncmp(packet, "qSupported", 10))
+    sprintf(reply, "PacketSize=%x;qXfer:features:read+;swbreak+;hwbreak+", GDB_PACKET_SIZE);
+  else if (!strncmp(packet, "qXfer:features:read:target.xml:", 31))
+  {
+    const char *p = packet + 31;
+    uint32_t offset = gdb_parse_hex(&p);
+    p++; // ','
+    uint32_t len = gdb_parse_hex(&p);
+    uint32_t total = strlen(gdb_target_xml);
+
+    if (len > GDB_PACKET_SIZE - 2)
+      len = GDB_PACKET_SIZE - 2;
+
+    if (offset >= total)
+      strcpy(reply, "l");
+    else
+    {
+      uint32_t left = total - offset;
+      reply[0] = left > len ? 'm' : 'l';
+      snprintf(reply + 1, (left > len ? len : left) + 1, "%s", gdb_target_xml + offset);
+    }
+  }
+  else if (!strcmp(packet, "qAttached"))
+    strcpy(reply, "1");
+  else if (!strcmp(packet, "qC"))
+    strcpy(reply, "QC1");
+  else if (!strcmp(packet, "qfThreadInfo"))
+    strcpy(reply, "m1");
+  else if (!strcmp(packet, "qsThreadInfo"))
+    strcpy(reply, "l");
+  else if (!strcmp(packet, "qOffsets"))
+    strcpy(reply, "Text=0;Data=0;Bss=0");
+  else if (!strncmp(packet, "qSymbol", 7))
+    strcpy(reply, "OK");
+  else
+    reply[0] = 0;
+}
+
+
+void gdb_serve(void) // handle packets until gdb continues or steps
+{
+  char packet[GDB_PACKET_SIZE];
+  char reply[GDB_PACKET_SIZE];
+
+  while (1)
+  {
+    if (gdb_recv_packet(packet) < 0)
+    {
+      gdb_detach();
+      return;
+    }
+
+    const char *p = packet + 1;
+    reply[0] = 0;
+
+    switch (packet[0])
+    {
+      case '?':
+      {
+        strcpy(reply, gdb_last_stop);
+        break;
+      }
+
+      case 'g':
+      {
+        for (uint32_t i = 0; i < GDB_REG_CSR0; i++)
+        {
+          uint32_t val;
+          gdb_read_reg(i, &val);
+          gdb_put_reg(reply + i * 8, val);
+        }
+        break;
+      }
+
+      case 'G':
+      {
+        for (uint32_t i = 0; i < GDB_REG_CSR0 && strlen(p) >= 8; i++)
+          gdb_write_reg(i, gdb_get_reg(&p));
+        strcpy(reply, "OK");
+        break;
+      }
+
+      case 'p':
+      {
+        uint32_t val;
+        if (gdb_read_reg(gdb_parse_hex(&p), &val) == 0)
+          gdb_put_reg(reply, val);
+        else
+          strcpy(reply, "E01");
+        break;
+      }
+
+      case 'P':
+      {
+        uint32_t n = gdb_parse_hex(&p);
+        p++; // '='
+        if (gdb_write_reg(n, gdb_get_reg(&p)) == 0)
+          strcpy(reply, "OK");
+        else
+          strcpy(reply, "E01");
+        break;
+      }
+
+      case 'm':
+      {
+        uint32_t addr = gdb_parse_hex(&p);
+        p++; // ','
+        uint32_t len = gdb_parse_hex(&p);
+
+        if (len > (GDB_PACKET_SIZE - 1) / 2)
+          len = (GDB_PACKET_SIZE - 1) / 2;
+
+        uint32_t i;
+        for (i = 0; i < len; i++)
+        {
+          uint8_t val;
+          if (gdb_read_byte(addr + i, &val) < 0)
+            break;
+          sprintf(reply + i * 2, "%02"PRIx8, val);
+        }
+
+        if (i == 0 && len > 0)
+          strcpy(reply, "E14");
+        break;
+      }
+
+      case 'M':
+      {
+        uint32_t addr = gdb_parse_hex(&p);
+        p++; // ','
+        uint32_t len = gdb_parse_hex(&p);
+        p++; // ':'
+
+        for (uint32_t i = 0; i < len && p[0] && p[1]; i++, p += 2)
+        {
+          char hex[3] = { p[0], p[1], 0 };
+          gdb_write_byte(addr + i, strtoul(hex, NULL, 16));
+        }
+        strcpy(reply, "OK");
+        break;
+      }
+
+      case 'Z':
+      case 'z':
+      {
+        uint8_t type = gdb_parse_hex(&p);
+        p++; // ','
+        uint32_t addr = gdb_parse_hex(&p);
+        p++; // ','
+        uint32_t len = gdb_parse_hex(&p);
+        int ok = -1;
+
+        if (type <= 1) // software and hardware breakpoints are both patched in
+          ok = packet[0] == 'Z' ? breakpoint_insert(addr, BP_GDB) : breakpoint_remove(addr, BP_GDB);
+        else if (type <= 4 && packet[0] == 'Z' && watchpoint_count < MAX_WATCHPOINTS)
+        {
+          watchpoints[watchpoint_count].addr = addr;
+          watchpoints[watchpoint_count].len = len;
+          watchpoints[watchpoint_count].type = type;
+          watchpoints[watchpoint_count].trace = 0;
+          watchpoint_count++;
+          ok = 0;
+        }
+        else if (type <= 4 && packet[0] == 'z')
+        {
+          for (uint32_t i = 0; i < watchpoint_count; i++)
+          {
+            if (watchpoints[i].addr == addr && watchpoints[i].len == len && watchpoints[i].type == type && !watchpoints[i].trace)
+            {
+              watchpoints[i] = watchpoints[--watchpoint_count];
+              ok = 0;
+              break;
+            }
+          }
+        }
+
+        strcpy(reply, ok == 0 ? "OK" : "E01");
+        break;
+      }
+
+      case 'c':
+      {
+        gdb_resume(p, 0);
+        return;
+      }
+
+      case 's':
+      {
+        gdb_resume(p, 1);
+        return;
+      }
+
+      case 'k':
+      {
+        fprintf(stderr, "# killed by gdb\n");
+        exit(-1);
+      }
+
+      case 'D':
+      {
+        gdb_send_packet("OK");
+        gdb_detach();
+        return;
+      }
+
+      case 'H':
+      case 'T':
+      {
+        strcpy(reply, "OK");
+        break;
+      }
+
+      case 'q':
+      {
+        gdb_handle_query(packet, reply);
+        break;
+      }
+
+      default: // unsupported, empty reply
+        break;
+    }
+
+    gdb_send_packet(reply);
+  }
+}
+
+
+void gdb_stop(const char *reason)
+{
+  strcpy(gdb_last_stop, reason);
+  gdb_stepping = 0;
+  gdb_send_packet(reason);
+
+  if (gdb_fd >= 0)
+    gdb_serve();
+}
+
+
+void gdb_poll(void) // non-blocking check for a ctrl-c from gdb
+{
+  if (gdb_rx_pos == gdb_rx_len)
+  {
+    struct pollfd pfd = { gdb_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) <= 0)
+      return;
+  }
+
+  int c = gdb_getc();
+  if (c < 0)
+    gdb_detach();
+  else if (c == 0x03)
+    gdb_stop("S02");
+}
+
+
+void gdb_report_exit(int ret)
+{
+  char reply[8];
+  if (run_result) // terminated by the 'signal' a real target would have gotten
+    sprintf(reply, "X%02x", run_result == RESULT_FAULT ? SIGSEGV : (run_result == RESULT_ILLEGAL ? SIGILL : SIGXCPU));
+  else
+    sprintf(reply, "W%02x", ret & 0xFF);
+  gdb_send_packet(reply);
+  close(gdb_fd);
+  gdb_fd = -1;
+}
+
+
+int gdb_listen(const char *where) // accepts one gdb connection on a tcp port (numeric) or unix socket path
+{
+  int server;
+  char *end;
+  long port = strtol(where, &end, 10);
+
+  if (*end == '\0')
+  {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int one = 1;
+    server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server >= 0)
+      setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+      fprintf(stderr, "!!! gdb: cannot bind port %ld: %s\n", port, strerror(errno));
+      return -1;
+    }
+  }
+  else
+  {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, where, sizeof(addr.sun_path) - 1);
+    unlink(where);
+
+    server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+      fprintf(stderr, "!!! gdb: cannot bind socket %s: %s\n", where, strerror(errno));
+      return -1;
+    }
+  }
+
+  if (listen(server, 1) < 0)
+  {
+    fprintf(stderr, "!!! gdb: listen failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  fprintf(stderr, "waiting for gdb on %s ...\n", where);
+  gdb_fd = accept(server, NULL, NULL);
+  close(server);
+
+  if (gdb_fd < 0)
+  {
+    fprintf(stderr, "!!! gdb: accept failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(gdb_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on unix sockets
+  signal(SIGPIPE, SIG_IGN);
+
+  int n = sprintf(gdb_target_xml, "<?xml version=\"1.0\"?><!DOCTYPE target SYSTEM \"gdb-target.dtd\"><target version=\"1.0\">"
+    "<architecture>riscv:rv32</architecture><feature name=\"org.gnu.gdb.riscv.cpu\">");
+  for (int i = 0; i < 32; i++)
+    n += sprintf(gdb_target_xml + n, "<reg name=\"x%d\" bitsize=\"32\" type=\"int\"/>", i);
+  n += sprintf(gdb_target_xml + n, "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/></feature><feature name=\"org.gnu.gdb.riscv.fpu\">");
+  for (int i = 0; i < 32; i++)
+    n += sprintf(gdb_target_xml + n, "<reg name=\"f%d\" bitsize=\"32\" type=\"ieee_single\" regnum=\"%d\"/>", i, GDB_REG_F0 + i);
+  n += sprintf(gdb_target_xml + n, "<reg name=\"fflags\" bitsize=\"32\" type=\"int\" regnum=\"%d\"/>", GDB_REG_CSR0 + CSR_FFLAGS);
+  n += sprintf(gdb_target_xml + n, "<reg name=\"frm\" bitsize=\"32\" type=\"int\" regnum=\"%d\"/>", GDB_REG_CSR0 + CSR_FRM);
+  sprintf(gdb_target_xml + n, "<reg name=\"fcsr\" bitsize=\"32\" type=\"int\" regnum=\"%d\"/></feature></target>", GDB_REG_CSR0 + CSR_FCSR);
+
+  fprintf(stderr, "gdb connected\n");
+  strcpy(gdb_last_stop, "S05");
+  schedule_event(inst_count + GDB_POLL_INTERVAL);
+  gdb_serve(); // the target starts out stopped
+  return 0;
+}
+
+
+// ---- record / replay of nondeterministic inputs ----
+
+// the log holds only what the guest could not compute itself, each value stamped with inst_count:
+//   "RVRR" <version> <binary size> <binary fnv-1a> <image size> <image fnv-1a>, then records of varint(inst_count delta) <kind> varint(value)
+// (no --blk image: size and hash 0)
+#define RR_MAGIC "RVRR"
+#define RR_VERSION 2
+#define RR_END 0 // last record, value = exit code
+#define RR_TIME 1 // time csr, low half
+#define RR_TIMEH 2 // time csr, high half
+#define RR_BLK_IN 3 // fnv-1a of the image data a blk IN request copied to the guest
+
+FILE *rr_file = NULL;
+uint8_t rr_replaying = 0;
+uint64_t rr_last_stamp = 0;
+
+uint8_t trace_window = 0; // trace only while trace_from <= inst_count < trace_to
+uint64_t trace_from = 0;
+uint64_t trace_to = UINT64_MAX;
+
+#define NO_PC 0xFFFFFFFF // never a valid (aligned) pc
+
+uint32_t trace_start_pc = NO_PC; // trace from the first execution of this pc ...
+uint32_t trace_stop_pc = NO_PC; // ... up to the first execution of this one after it
+uint32_t trace_store_addr = NO_PC; // trace from the first store to this address on
+uint64_t trace_every = 0; // trace every nth instruction
+uint64_t trace_sample_at = 0;
+uint8_t trace_sampled = 0;
+
+
+uint32_t fnv1a(const uint8_t *data, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ data[i]) * 16777619u;
+  return hash;
+}
+
+
+void put_varint(FILE *f, uint64_t val)
+{
+  do
+  {
+    uint8_t byte = val & 0x7F;
+    val >>= 7;
+    fputc(byte | (val ? 0x80 : 0), f);
+  } while (val);
+}
+
+
+int get_varint(FILE *f, uint64_t *val)
+{
+  *val = 0;
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    int byte = fgetc(f);
+    if (byte == EOF)
+      return -1;
+
+    *val |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+
+int rr_open(const char *path, uint8_t replay, uint32_t binary_size, uint32_t binary_hash, uint64_t image_size, uint32_t image_hash)
+{
+  rr_file = fopen(path, replay ? "rb" : "wb");
+  if (!rr_file)
+  {
+    fprintf(stderr, "!!! rr: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  rr_replaying = replay;
+
+  if (!replay)
+  {
+    fwrite(RR_MAGIC, 1, 4, rr_file);
+    put_varint(rr_file, RR_VERSION);
+    put_varint(rr_file, binary_size);
+    put_varint(rr_file, binary_hash);
+    put_varint(rr_file, image_size);
+    put_varint(rr_file, image_hash);
+    return 0;
+  }
+
+  char magic[4];
+  uint64_t version, size, hash, img_size, img_hash;
+  if (fread(magic, 1, 4, rr_file) != 4 || memcmp(magic, RR_MAGIC, 4) || get_varint(rr_file, &version) < 0 || version != RR_VERSION
+    || get_varint(rr_file, &size) < 0 || get_varint(rr_file, &hash) < 0 || get_varint(rr_file, &img_size) < 0 || get_varint(rr_file, &img_hash) < 0)
+  {
+    fprintf(stderr, "!!! rr: %s is not a recording\n", path);
+    return -1;
+  }
+
+  if (size != binary_size || hash != binary_hash)
+  {
+    fprintf(stderr, "!!! rr: %s was recorded with a different binary\n", path);
+    return -1;
+  }
+
+  if (img_size != image_size || img_hash != image_hash) // OUT requests during --record changed it, restore the image first
+  {
+    fprintf(stderr, "!!! rr: %s was recorded with a different blk image\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+uint32_t rr_input(uint8_t kind, uint32_t val) // every nondeterministic value the guest sees goes through here
+{
+  if (!rr_file)
+    return val;
+
+  if (!rr_replaying)
+  {
+    put_varint(rr_file, inst_count - rr_last_stamp);
+    fputc(kind, rr_file);
+    put_varint(rr_file, val);
+    rr_last_stamp = inst_count;
+    return val;
+  }
+
+  uint64_t delta, recorded;
+  int rec_kind = EOF;
+  if (get_varint(rr_file, &delta) < 0 || (rec_kind = fgetc(rr_file)) == EOF || get_varint(rr_file, &recorded) < 0
+    || rr_last_stamp + delta != inst_count || rec_kind != kind)
+  {
+    fprintf(stderr, "!!! rr: replay diverged at instruction %"PRIu64" (input kind %"PRIu8", recorded kind %d)\n", inst_count, kind, rec_kind);
+    abort();
+  }
+
+  rr_last_stamp = inst_count;
+  return recorded;
+}
+
+
+void rr_finish(int ret)
+{
+  if (!rr_file)
+    return;
+
+  uint64_t delta, recorded;
+  if (!rr_replaying)
+  {
+    rr_input(RR_END, ret);
+  }
+  else if (get_varint(rr_file, &delta) < 0 || fgetc(rr_file) != RR_END || get_varint(rr_file, &recorded) < 0)
+    fprintf(stderr, "!!! rr: replay ended at instruction %"PRIu64" before the recording did\n", inst_count);
+  else if (rr_last_stamp + delta != inst_count || (uint32_t)recorded != (uint32_t)ret)
+    fprintf(stderr, "!!! rr: replay ended at instruction %"PRIu64" with %d, recording at %"PRIu64" with %"PRIi32"\n",
+      inst_count, ret, rr_last_stamp + delta, (int32_t)recorded);
+  else
+    printf("# replay matched the recording (%"PRIu64" instructions)\n", inst_count);
+
+  fclose(rr_file);
+  rr_file = NULL;
+}
+
+
+int trace_arm(void) // triggers go through breakpoints and watchpoints, so execute() pays nothing until they fire
+{
+  if (trace_start_pc != NO_PC)
+  {
+    if (breakpoint_insert(trace_start_pc, BP_TRACE_ON) < 0)
+    {
+      fprintf(stderr, "!!! trace: no code at 0x%"PRIx32"\n", trace_start_pc);
+      return -1;
+    }
+    trace_gate(TRACE_GATE_PC, 0);
+  }
+
+  if (trace_store_addr != NO_PC)
+  {
+    watchpoint_t *wp = &watchpoints[watchpoint_count++];
+    wp->addr = trace_store_addr;
+    wp->len = 1;
+    wp->type = 2;
+    wp->trace = 1;
+    trace_gate(TRACE_GATE_STORE, 0);
+  }
+
+  if (trace_every)
+  {
+    trace_gate(TRACE_GATE_SAMPLE, 0);
+    schedule_event(0);
+  }
+
+  if (trace_window)
+  {
+    trace_gate(TRACE_GATE_WINDOW, 0);
+    schedule_event(0);
+  }
+
+  return 0;
+}
+
+
+void trace_trigger(breakpoint_t *bp) // from execute() when a trace start / stop pc is reached
+{
+  if (bp->owners & BP_TRACE_ON)
+  {
+    breakpoint_remove(bp->addr, BP_TRACE_ON);
+    trace_gate(TRACE_GATE_PC, 1);
+
+    if (trace_stop_pc != NO_PC)
+      breakpoint_insert(trace_stop_pc, BP_TRACE_OFF);
+  }
+  else
+  {
+    breakpoint_remove(bp->addr, BP_TRACE_OFF);
+    trace_gate(TRACE_GATE_PC, 0);
+  }
+}
+
+
+void trace_sample(void) // traces one instruction, then stays silent for trace_every - 1
+{
+  if (trace_sampled)
+  {
+    trace_gate(TRACE_GATE_SAMPLE, 0);
+    trace_sampled = 0;
+  }
+
+  if (inst_count >= trace_sample_at)
+  {
+    trace_gate(TRACE_GATE_SAMPLE, 1);
+    trace_sampled = 1;
+    trace_sample_at = inst_count + trace_every;
+    schedule_event(inst_count + 1);
+  }
+
+  schedule_event(trace_sample_at);
+}
+
+
+void trace_update(void) // switches the trace on and off at the window edges
+{
+  if (inst_count >= trace_to)
+  {
+    trace_gate(TRACE_GATE_WINDOW, 0);
+    trace_window = 0;
+  }
+  else if (inst_count >= trace_from)
+  {
+    trace_gate(TRACE_GATE_WINDOW, 1);
+    schedule_event(trace_to);
+  }
+  else
+  {
+    trace_gate(TRACE_GATE_WINDOW, 0);
+    schedule_event(trace_from);
+  }
+}
+
+
+#define RUN_CHECK_INTERVAL (1 << 20) // instructions between wall clock checks
+
+
+uint64_t run_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void run_check_limits(void)
+{
+  if (run_max_instructions)
+  {
+    if (inst_count >= run_max_instructions)
+    {
+      fprintf(stderr, "!!! instruction budget of %"PRIu64" exhausted\n", run_max_instructions);
+      run_stop(RESULT_TIMEOUT);
+      return;
+    }
+
+    schedule_event(run_max_instructions);
+  }
+
+  if (run_deadline_ns)
+  {
+    if (run_now_ns() >= run_deadline_ns)
+    {
+      fprintf(stderr, "!!! wall clock timeout after %"PRIu64" instructions\n", inst_count);
+      run_stop(RESULT_TIMEOUT);
+      return;
+    }
+
+    schedule_event(inst_count + RUN_CHECK_INTERVAL);
+  }
+}
+
+
+// ---- cache and memory latency model ----
+
+#define TIMING_MAX_FUNCS 4096 // power of 2
+#define TIMING_MAX_DEPTH 1024
+
+typedef struct
+{
+  const char *name;
+  uint32_t size, ways, line;
+  uint32_t sets, line_shift;
+  uint32_t *tags; // sets * ways, line address + 1, 0 = invalid
+  uint64_t *used; // sets * ways, last access stamp for lru
+  uint64_t hits, misses;
+} cache_t;
+
+typedef struct
+{
+  uint32_t entry; // function address + 1, 0 = free slot
+  uint64_t cycles; // self cycles
+  uint64_t calls;
+} timing_func_t;
+
+uint8_t timing = 0; // any cache configured, hooks in execute() are skipped entirely otherwise
+uint32_t miss_latency = 20;
+uint64_t timing_cycles = 0;
+uint64_t timing_stamp = 0;
+
+cache_t icache = { "icache" };
+cache_t dcache = { "dcache" };
+
+timing_func_t timing_funcs[TIMING_MAX_FUNCS];
+uint32_t timing_stack[TIMING_MAX_DEPTH];
+uint32_t timing_depth = 0;
+uint32_t timing_func = 0; // entry of the function currently executing
+uint64_t timing_func_start = 0; // timing_cycles when timing_func was entered
+
+
+int cache_config(cache_t *c, const char *spec) // "<size>,<ways>,<line size>" in bytes
+{
+  if (sscanf(spec, "%"SCNu32",%"SCNu32",%"SCNu32, &c->size, &c->ways, &c->line) != 3 || !c->ways || !c->line)
+    return -1;
+
+  c->sets = c->size / c->ways / c->line;
+  if (!c->sets || (c->sets & (c->sets - 1)) || (c->line & (c->line - 1)))
+  {
+    fprintf(stderr, "!!! %s: sets and line size must be powers of 2\n", c->name);
+    return -1;
+  }
+
+  for (c->line_shift = 0; (1u << c->line_shift) < c->line; c->line_shift++);
+
+  c->tags = calloc(c->sets * c->ways, sizeof(uint32_t));
+  c->used = calloc(c->sets * c->ways, sizeof(uint64_t));
+  timing = 1;
+  return 0;
+}
+
+
+uint8_t cache_access(cache_t *c, uint32_t addr) // returns 1 on a miss
+{
+  if (!c->tags)
+    return 0;
+
+  uint32_t tag = (addr >> c->line_shift) + 1;
+  uint32_t set = ((addr >> c->line_shift) & (c->sets - 1)) * c->ways;
+  uint32_t victim = set;
+
+  timing_stamp++;
+
+  for (uint32_t i = set; i < set + c->ways; i++)
+  {
+    if (c->tags[i] == tag)
+    {
+      c->used[i] = timing_stamp;
+      c->hits++;
+      return 0;
+    }
+
+    if (c->used[i] < c->used[victim])
+      victim = i;
+  }
+
+  c->tags[victim] = tag;
+  c->used[victim] = timing_stamp;
+  c->misses++;
+  return 1;
+}
+
+
+void timing_fetch(uint32_t pc)
+{
+  timing_cycles += 1;
+  if (cache_access(&icache, pc))
+    timing_cycles += miss_latency;
+}
+
+
+void timing_data(uint32_t addr)
+{
+  if (cache_access(&dcache, addr))
+    timing_cycles += miss_latency;
+}
+
+
+void timing_data_range(uint32_t addr, uint32_t len) // one access per cache line touched
+{
+  if (!dcache.tags || !len)
+    return;
+
+  for (uint32_t line = addr >> dcache.line_shift; line <= (addr + len - 1) >> dcache.line_shift; line++)
+    timing_data(line << dcache.line_shift);
+}
+
+
+timing_func_t *timing_func_get(uint32_t entry)
+{
+  uint32_t i = (entry >> 2) & (TIMING_MAX_FUNCS - 1);
+
+  for (uint32_t n = 0; n < TIMING_MAX_FUNCS; n++, i = (i + 1) & (TIMING_MAX_FUNCS - 1))
+  {
+    if (timing_funcs[i].entry == entry + 1)
+      return &timing_funcs[i];
+
+    if (!timing_funcs[i].entry)
+    {
+      timing_funcs[i].entry = entry + 1;
+      return &timing_funcs[i];
+    }
+  }
+
+  return &timing_funcs[0]; // table full, lump the rest together
+}
+
+
+void timing_switch(uint32_t entry) // charge the cycles so far to the current function and continue in entry
+{
+  timing_func_get(timing_func)->cycles += timing_cycles - timing_func_start;
+  timing_func = entry;
+  timing_func_start = timing_cycles;
+}
+
+
+void timing_jump(uint8_t rd, uint8_t rs1, uint32_t target) // from JAL / JALR: calls link into ra, returns jump through ra
+{
+  if (rd == 1)
+  {
+    if (timing_depth < TIMING_MAX_DEPTH)
+      timing_stack[timing_depth++] = timing_func;
+
+    timing_switch(target);
+    timing_func_get(target)->calls++;
+  }
+  else if (rd == 0 && rs1 == 1 && timing_depth)
+    timing_switch(timing_stack[--timing_depth]);
+}
+
+
+int timing_func_cmp(const void *a, const void *b)
+{
+  const timing_func_t *fa = a, *fb = b;
+  return fa->cycles < fb->cycles ? 1 : (fa->cycles > fb->cycles ? -1 : 0);
+}
+
+
+void cache_report(cache_t *c)
+{
+  if (!c->tags)
+    return;
+
+  uint64_t total = c->hits + c->misses;
+  printf("# %s: %"PRIu32" bytes, %"PRIu32" ways, %"PRIu32" byte lines: %"PRIu64" hits, %"PRIu64" misses (%.2f%% miss rate)\n",
+    c->name, c->size, c->ways, c->line, c->hits, c->misses, total ? 100.0 * c->misses / total : 0.0);
+}
+
+
+void timing_report(void)
+{
+  timing_switch(timing_func);
+
+  printf("# timing: %"PRIu64" cycles for %"PRIu64" instructions (CPI %.2f), miss latency %"PRIu32" cycles\n",
+    timing_cycles, inst_count, inst_count ? (double)timing_cycles / inst_count : 0.0, miss_latency);
+  cache_report(&icache);
+  cache_report(&dcache);
+
+  qsort(timing_funcs, TIMING_MAX_FUNCS, sizeof(timing_func_t), timing_func_cmp);
+
+  printf("# cycles per function (self):\n");
+  for (uint32_t i = 0; i < TIMING_MAX_FUNCS && timing_funcs[i].entry; i++)
+  {
+    printf("#   0x%08"PRIx32": %"PRIu64" cycles (%.1f%%), %"PRIu64" calls\n", timing_funcs[i].entry - 1, timing_funcs[i].cycles,
+      timing_cycles ? 100.0 * timing_funcs[i].cycles / timing_cycles : 0.0, timing_funcs[i].calls);
+  }
+}
+
+
+// ---- memory access heatmap and working set ----
+
+// counters live in 4 MiB chunks of the address space, allocated on the first access to a chunk.
+// nothing is printed while the guest runs, heat_report() writes everything at exit
+#define HEAT_CHUNK_SHIFT 22
+#define HEAT_CHUNKS (1u << (32 - HEAT_CHUNK_SHIFT))
+
+#define HEAT_READ 0
+#define HEAT_WRITE 1
+#define HEAT_FETCH 2
+
+typedef struct
+{
+  uint64_t count[3]; // HEAT_READ, HEAT_WRITE, HEAT_FETCH
+  uint64_t window; // last working set window the page was touched in
+} heat_page_t;
+
+uint8_t heat = 0; // profiling enabled, hooks in execute() are skipped entirely otherwise
+const char *heat_file = NULL; // .json for json, csv otherwise
+uint32_t heat_page_shift = 12;
+uint32_t heat_line_shift = 0; // 0 = no per line counters
+uint64_t heat_window_len = 1000000; // instructions per working set window
+
+heat_page_t *heat_pages[HEAT_CHUNKS];
+uint64_t (*heat_lines[HEAT_CHUNKS])[3];
+
+uint64_t heat_window = 1; // current window, pages start out with window 0 = never touched
+uint64_t heat_window_start = 0; // inst_count the first window started at
+uint64_t heat_window_end = 0;
+uint32_t heat_window_pages = 0; // distinct pages touched in the current window
+uint32_t *heat_working_set = NULL; // pages touched per finished window
+uint64_t heat_windows = 0;
+
+
+int heat_shift(const char *spec, uint32_t *shift) // power of two size in bytes to a shift, at most a chunk
+{
+  uint32_t size = strtoul(spec, NULL, 0);
+  if (!size || (size & (size - 1)) || size > (1u << HEAT_CHUNK_SHIFT))
+  {
+    fprintf(stderr, "!!! heatmap: %s is not a power of two up to %u\n", spec, 1u << HEAT_CHUNK_SHIFT);
+    return -1;
+  }
+
+  for (*shift = 0; (1u << *shift) < size; (*shift)++);
+  return 0;
+}
+
+
+void heat_access(uint32_t addr, uint32_t len, uint8_t kind) // one count per page (and line) touched by [addr, addr + len)
+{
+  if (!len)
+    return;
+
+  uint32_t last = addr + len - 1;
+  if (last < addr) // wraps around
+    last = UINT32_MAX;
+
+  for (uint32_t page = addr >> heat_page_shift; page <= last >> heat_page_shift; page++)
+  {
+    uint32_t chunk = page >> (HEAT_CHUNK_SHIFT - heat_page_shift);
+    if (!heat_pages[chunk])
+      heat_pages[chunk] = calloc(1u << (HEAT_CHUNK_SHIFT - heat_page_shift), sizeof(heat_page_t));
+
+    heat_page_t *p = &heat_pages[chunk][page & ((1u << (HEAT_CHUNK_SHIFT - heat_page_shift)) - 1)];
+    p->count[kind]++;
+
+    if (p->window != heat_window)
+    {
+      p->window = heat_window;
+      heat_window_pages++;
+    }
+
+    if (page == UINT32_MAX >> heat_page_shift)
+      break;
+  }
+
+  if (!heat_line_shift)
+    return;
+
+  for (uint32_t line = addr >> heat_line_shift; line <= last >> heat_line_shift; line++)
+  {
+    uint32_t chunk = line >> (HEAT_CHUNK_SHIFT - heat_line_shift);
+    if (!heat_lines[chunk])
+      heat_lines[chunk] = calloc(1u << (HEAT_CHUNK_SHIFT - heat_line_shift), sizeof(heat_lines[chunk][0]));
+
+    heat_lines[chunk][line & ((1u << (HEAT_CHUNK_SHIFT - heat_line_shift)) - 1)][kind]++;
+
+    if (line == UINT32_MAX >> heat_line_shift)
+      break;
+  }
+}
+
+
+void heat_end_window(void)
+{
+  heat_working_set = realloc(heat_working_set, (heat_windows + 1) * sizeof(uint32_t));
+  heat_working_set[heat_windows++] = heat_window_pages;
+  heat_window_pages = 0;
+  heat_window++;
+}
+
+
+void heat_arm(void)
+{
+  heat = 1;
+  heat_window_start = inst_count;
+  heat_window_end = inst_count + heat_window_len;
+  schedule_event(heat_window_end);
+}
+
+
+void heat_update(void) // from handle_events()
+{
+  while (inst_count >= heat_window_end)
+  {
+    heat_end_window();
+    heat_window_end += heat_window_len;
+  }
+
+  schedule_event(heat_window_end);
+}
+
+
+void heat_put_row(FILE *f, uint8_t json, const char *kind, uint32_t addr, const uint64_t *count, uint8_t *first)
+{
+  if (json)
+    fprintf(f, "%s\n    { \"addr\": %"PRIu32", \"reads\": %"PRIu64", \"writes\": %"PRIu64", \"fetches\": %"PRIu64" }", *first ? "" : ",", addr, count[0], count[1], count[2]);
+  else
+    fprintf(f, "%s,0x%08"PRIx32",%"PRIu64",%"PRIu64",%"PRIu64"\n", kind, addr, count[0], count[1], count[2]);
+  *first = 0;
+}
+
+
+int heat_report(void)
+{
+  heat_end_window(); // the partial last one
+
+  FILE *f = fopen(heat_file, "w");
+  if (!f)
+  {
+    fprintf(stderr, "!!! heatmap: cannot open %s: %s\n", heat_file, strerror(errno));
+    return -1;
+  }
+
+  size_t name_len = strlen(heat_file);
+  uint8_t json = name_len >= 5 && !strcmp(heat_file + name_len - 5, ".json");
+  uint32_t per_chunk = 1u << (HEAT_CHUNK_SHIFT - heat_page_shift);
+  uint8_t first = 1;
+
+  if (json)
+    fprintf(f, "{\n  \"page_size\": %u,\n  \"line_size\": %u,\n  \"window\": %"PRIu64",\n  \"first_instruction\": %"PRIu64",\n  \"pages\": [",
+      1u << heat_page_shift, heat_line_shift ? 1u << heat_line_shift : 0, heat_window_len, heat_window_start);
+  else
+    fprintf(f, "kind,addr,reads,writes,fetches\n"); // working set rows: window,<first instruction>,<pages touched>,,
+
+  for (uint32_t chunk = 0; chunk < HEAT_CHUNKS; chunk++)
+  {
+    for (uint32_t i = 0; heat_pages[chunk] && i < per_chunk; i++)
+    {
+      if (heat_pages[chunk][i].window)
+        heat_put_row(f, json, "page", (chunk << HEAT_CHUNK_SHIFT) | (i << heat_page_shift), heat_pages[chunk][i].count, &first);
+    }
+  }
+
+  if (heat_line_shift)
+  {
+    per_chunk = 1u << (HEAT_CHUNK_SHIFT - heat_line_shift);
+    first = 1;
+    if (json)
+      fprintf(f, "\n  ],\n  \"lines\": [");
+
+    for (uint32_t chunk = 0; chunk < HEAT_CHUNKS; chunk++)
+    {
+      for (uint32_t i = 0; heat_lines[chunk] && i < per_chunk; i++)
+      {
+        const uint64_t *count = heat_lines[chunk][i];
+        if (count[0] || count[1] || count[2])
+          heat_put_row(f, json, "line", (chunk << HEAT_CHUNK_SHIFT) | (i << heat_line_shift), count, &first);
+      }
+    }
+  }
+
+  if (json)
+    fprintf(f, "\n  ],\n  \"working_set\": [");
+
+  for (uint64_t w = 0; w < heat_windows; w++)
+  {
+    if (json)
+      fprintf(f, "%s%"PRIu32, w ? ", " : "", heat_working_set[w]);
+    else
+      fprintf(f, "window,%"PRIu64",%"PRIu32",,\n", heat_window_start + w * heat_window_len, heat_working_set[w]);
+  }
+
+  if (json)
+    fprintf(f, "]\n}\n");
+
+  fclose(f);
+  printf("# heatmap: %"PRIu64" windows written to %s\n", heat_windows, heat_file);
+  return 0;
+}
+
+
+// ---- Zicsr control and status registers ----
+
+int csr_read(uint16_t csr, uint32_t *val, uint8_t in_instruction) // -1 if csr does not exist
+{
+  // counters are derived when read, execute() keeps no state for them; a reading instruction hasn't retired yet
+  uint64_t retired = inst_count - in_instruction;
+
+  switch (csr)
+  {
+    case CSR_CYCLE:
+    case CSR_CYCLEH:
+    {
+      uint64_t cycles = timing ? timing_cycles : retired; // one cycle per instruction without the timing model
+      *val = csr == CSR_CYCLE ? (uint32_t)cycles : (uint32_t)(cycles >> 32);
+      return 0;
+    }
+
+    case CSR_TIME:
+    case CSR_TIMEH:
+    {
+      uint64_t us = run_now_ns() / 1000; // microseconds of the host's monotonic clock
+      *val = csr == CSR_TIME ? rr_input(RR_TIME, us) : rr_input(RR_TIMEH, us >> 32);
+      return 0;
+    }
+
+    case CSR_INSTRET:
+    case CSR_INSTRETH:
+      *val = csr == CSR_INSTRET ? (uint32_t)retired : (uint32_t)(retired >> 32);
+      return 0;
+
+    case CSR_FFLAGS:
+      *val = fp_fflags();
+      return 0;
+
+    case CSR_FRM:
+      *val = (cpu.fcsr >> 5) & 0b111;
+      return 0;
+
+    case CSR_FCSR:
+      fp_fflags();
+      *val = cpu.fcsr & 0xFF;
+      return 0;
+  }
+
+  return -1;
+}
+
+
+int csr_write(uint16_t csr, uint32_t val) // -1 if csr does not exist or is read-only
+{
+  switch (csr)
+  {
+    case CSR_FFLAGS:
+      feclearexcept(FE_ALL_EXCEPT);
+      cpu.fcsr = (cpu.fcsr & ~0x1F) | (val & 0x1F);
+      return 0;
+
+    case CSR_FRM:
+      cpu.fcsr = (cpu.fcsr & 0x1F) | ((val & 0b111) << 5);
+      return 0;
+
+    case CSR_FCSR:
+      feclearexcept(FE_ALL_EXCEPT);
+      cpu.fcsr = val & 0xFF;
+      return 0;
+  }
+
+  return -1;
+}
+
+
+// ---- virtio style block device on a host image file ----
+
+// registers are 32 bit words at BLK_BASE, only reachable with LW / SW. the queue is a virtio split ring in guest memory:
+//   descriptors: { u64 addr, u32 len, u16 flags, u16 next }, avail: { u16 flags, u16 idx, u16 ring[num] },
+//   used: { u16 flags, u16 idx, { u32 id, u32 len } ring[num] }
+// a request is a chain of a header { u32 type, u32 reserved, u64 sector }, data buffers and a one byte status.
+// there are no interrupts, the guest polls used idx or BLK_STATUS after writing BLK_NOTIFY
+#define BLK_BASE 0xF0000000
+#define BLK_MAGIC 0x00 // "virt"
+#define BLK_CAPACITY 0x04 // in 512 byte sectors, low half
+#define BLK_CAPACITY_HI 0x08
+#define BLK_QUEUE_NUM 0x0C // ring size
+#define BLK_QUEUE_DESC 0x10 // guest addresses of the rings
+#define BLK_QUEUE_AVAIL 0x14
+#define BLK_QUEUE_USED 0x18
+#define BLK_NOTIFY 0x1C // write: process every available request
+#define BLK_STATUS 0x20 // bit 0: requests completed since the last ack
+#define BLK_ACK 0x24 // write: clears the given status bits
+#define BLK_REG_SPACE 0x28
+
+#define BLK_T_IN 0
+#define BLK_T_OUT 1
+#define BLK_T_FLUSH 4
+
+#define BLK_S_OK 0
+#define BLK_S_IOERR 1
+#define BLK_S_UNSUPP 2
+
+#define BLK_DESC_NEXT 1
+#define BLK_DESC_WRITE 2 // device writes into the buffer
+
+#define BLK_SECTOR 512
+
+uint8_t *blk_image = NULL; // the image file, mapped shared so guest writes go to the file (private while replaying)
+uint64_t blk_size = 0;
+uint32_t blk_queue_num = 0;
+uint32_t blk_queue_desc = 0;
+uint32_t blk_queue_avail = 0;
+uint32_t blk_queue_used = 0;
+uint16_t blk_last_avail = 0; // next avail ring entry the device looks at
+uint32_t blk_status = 0;
+uint64_t blk_requests = 0;
+
+
+int blk_open(const char *path, uint8_t keep_writes)
+{
+  FILE *f = fopen(path, keep_writes ? "r+" : "r");
+  if (!f)
+  {
+    fprintf(stderr, "!!! blk: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  fseek(f, 0L, SEEK_END);
+  blk_size = ftell(f);
+
+  if (blk_size < BLK_SECTOR)
+  {
+    fprintf(stderr, "!!! blk: %s is smaller than a sector\n", path);
+    fclose(f);
+    return -1;
+  }
+
+  blk_image = mmap(NULL, blk_size, PROT_READ | PROT_WRITE, keep_writes ? MAP_SHARED : MAP_PRIVATE, fileno(f), 0);
+  fclose(f);
+
+  if (blk_image == MAP_FAILED)
+  {
+    fprintf(stderr, "!!! blk: cannot map %s: %s\n", path, strerror(errno));
+    blk_image = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+
+uint8_t blk_request(uint16_t head, uint32_t *written) // runs one descriptor chain, returns its status
+{
+  uint8_t desc[16];
+  uint8_t header[16];
+  uint32_t status_addr = 0;
+  uint64_t offset = 0;
+  uint32_t type = 0;
+  uint8_t status = BLK_S_OK;
+  uint16_t index = head;
+
+  *written = 0;
+
+  for (uint32_t n = 0; n < blk_queue_num; n++) // a chain can't be longer than the ring, stops loops
+  {
+    if (mem_load_range(blk_queue_desc + (index % blk_queue_num) * 16, desc, 16) < 0)
+      return BLK_S_IOERR;
+
+    uint32_t addr = desc[0] | desc[1] << 8 | desc[2] << 16 | (uint32_t)desc[3] << 24;
+    uint32_t addr_hi = desc[4] | desc[5] << 8 | desc[6] << 16 | (uint32_t)desc[7] << 24;
+    uint32_t len = desc[8] | desc[9] << 8 | desc[10] << 16 | (uint32_t)desc[11] << 24;
+    uint16_t flags = desc[12] | desc[13] << 8;
+    uint16_t next = desc[14] | desc[15] << 8;
+
+    if (addr_hi)
+      status = BLK_S_IOERR;
+    else if (n == 0) // header
+    {
+      if (len < 16 || (flags & BLK_DESC_WRITE) || mem_load_range(addr, header, 16) < 0)
+        return BLK_S_IOERR;
+
+      type = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t)header[3] << 24;
+      uint64_t sector = 0;
+      for (int i = 0; i < 8; i++)
+        sector |= (uint64_t)header[8 + i] << (i * 8);
+      offset = sector * BLK_SECTOR;
+
+      if (type != BLK_T_IN && type != BLK_T_OUT && type != BLK_T_FLUSH)
+        status = BLK_S_UNSUPP;
+    }
+    else if (!(flags & BLK_DESC_NEXT)) // status byte, always last
+    {
+      if (!(flags & BLK_DESC_WRITE) || len < 1 || mem_range_in_code(addr, 1))
+        return BLK_S_IOERR;
+      status_addr = addr;
+    }
+    else if (status == BLK_S_OK && type != BLK_T_FLUSH) // data, straight between the mapping and guest memory
+    {
+      if (offset > blk_size || len > blk_size - offset)
+        status = BLK_S_IOERR;
+      else if (!(flags & BLK_DESC_WRITE) != (type == BLK_T_OUT)) // IN buffers must be device writable, OUT ones read-only
+        status = BLK_S_IOERR;
+      else if (type == BLK_T_IN && mem_range_in_code(addr, len))
+        status = BLK_S_IOERR;
+      else if (type == BLK_T_IN)
+      {
+        uint32_t hash = rr_file ? fnv1a(blk_image + offset, len) : 0;
+        if (rr_input(RR_BLK_IN, hash) != hash)
+        {
+          fprintf(stderr, "!!! rr: replay diverged at instruction %"PRIu64" (blk read at offset %"PRIu64" differs from the recording)\n", inst_count, offset);
+          abort();
+        }
+
+        mem_store_range(addr, blk_image + offset, 0, len);
+        *written += len;
+      }
+      else if (mem_load_range(addr, blk_image + offset, len) < 0)
+        status = BLK_S_IOERR;
+
+      offset += len;
+    }
+
+    if (!(flags & BLK_DESC_NEXT))
+      break;
+    index = next;
+  }
+
+  if (status == BLK_S_OK && type == BLK_T_FLUSH && msync(blk_image, blk_size, MS_SYNC) < 0)
+    status = BLK_S_IOERR;
+
+  if (status_addr)
+  {
+    mem_store_range(status_addr, NULL, status, 1);
+    *written += 1;
+  }
+
+  return status;
+}
+
+
+
+uint16_t blk_load_16(uint32_t addr, uint8_t *ok)
+{
+  uint8_t bytes[2] = { 0 };
+  if (mem_load_range(addr, bytes, 2) < 0)
+    *ok = 0;
+  return bytes[0] | bytes[1] << 8;
+}
+
+
+void blk_notify(void) // handles every request made available since the last notify, then publishes used idx once
+{
+  if (!blk_queue_num)
+  {
+    fprintf(stderr, "!!! blk: notified before the queue was set up\n");
+    return;
+  }
+
+  uint8_t ok = 1;
+  uint16_t avail_idx = blk_load_16(blk_queue_avail + 2, &ok);
+  uint16_t used_idx = blk_load_16(blk_queue_used + 2, &ok);
+
+  if (!ok)
+  {
+    fprintf(stderr, "!!! blk: avail or used ring not in guest memory\n");
+    return;
+  }
+
+  uint16_t count = avail_idx - blk_last_avail;
+  if (count > blk_queue_num)
+  {
+    fprintf(stderr, "!!! blk: guest made %"PRIu16" requests available on a ring of %"PRIu32"\n", count, blk_queue_num);
+    return;
+  }
+
+  for (uint16_t i = 0; i < count; i++, blk_last_avail++, used_idx++)
+  {
+    uint16_t head = blk_load_16(blk_queue_avail + 4 + (blk_last_avail % blk_queue_num) * 2, &ok);
+    uint32_t written = 0;
+    uint8_t status = ok ? blk_request(head, &written) : BLK_S_IOERR;
+
+    uint8_t elem[8] = { head, head >> 8, 0, 0, written, written >> 8, written >> 16, written >> 24 };
+    mem_store_range(blk_queue_used + 4 + (used_idx % blk_queue_num) * 8, elem, 0, 8);
+
+    if (!silent)
+      printf("blk: request %"PRIu16", status = %"PRIu8", written = %"PRIu32"\n", head, status, written);
+  }
+
+  uint8_t idx[2] = { used_idx, used_idx >> 8 };
+  mem_store_range(blk_queue_used + 2, idx, 0, 2);
+
+  blk_requests += count;
+  if (count)
+    blk_status |= 1;
+}
+
+
+uint32_t blk_read(uint32_t reg)
+{
+  switch (reg)
+  {
+    case BLK_MAGIC: return 0x74726976;
+    case BLK_CAPACITY: return blk_size / BLK_SECTOR;
+    case BLK_CAPACITY_HI: return (blk_size / BLK_SECTOR) >> 32;
+    case BLK_QUEUE_NUM: return blk_queue_num;
+    case BLK_QUEUE_DESC: return blk_queue_desc;
+    case BLK_QUEUE_AVAIL: return blk_queue_avail;
+    case BLK_QUEUE_USED: return blk_queue_used;
+    case BLK_STATUS: return blk_status;
+  }
+
+  return 0;
+}
+
+
+void blk_write(uint32_t reg, uint32_t val)
+{
+  if (reg == BLK_QUEUE_NUM) // the u16 ring indexes wrap cleanly only for powers of two
+  {
+    if (val > 32768 || (val & (val - 1)))
+    {
+      fprintf(stderr, "!!! blk: queue size %"PRIu32" is not a power of two up to 32768\n", val);
+      val = 0;
+    }
+
+    blk_queue_num = val;
+    blk_last_avail = 0;
+    return;
+  }
+
+  switch (reg)
+  {
+    case BLK_QUEUE_DESC: blk_queue_desc = val; break;
+    case BLK_QUEUE_AVAIL: blk_queue_avail = val; break;
+    case BLK_QUEUE_USED: blk_queue_used = val; break;
+    case BLK_NOTIFY: blk_notify(); break;
+    case BLK_ACK: blk_status &= ~val; break;
+  }
+}
+
+
+// ---- checkpoint / resume ----
+
+// "RVCP" <version> <binary size> <binary fnv-1a>, then the machine state as varints:
+//   x1-x31, pc, f0-f31, fcsr, inst_count, timing_cycles, the block device's queue registers,
+// then the guest's mem blocks as runs of consecutive addresses: varint(addr) varint(len) and len bytes,
+// run length encoded as varint(n << 1) + n literal bytes or varint(n << 1 | 1) + one byte repeated n times.
+// runs end with a zero length run. compression is this run length encoding only, no general purpose compressor
+#define CP_MAGIC "RVCP"
+#define CP_VERSION 1
+#define CP_POLL_INTERVAL (1 << 20) // instructions between checks for SIGUSR1
+#define CP_MIN_REPEAT 4 // shorter repeats stay literal
+
+const char *checkpoint_file = NULL;
+uint64_t checkpoint_every = 0; // instructions between periodic checkpoints, 0 = only on SIGUSR1
+uint64_t checkpoint_at = 0;
+volatile sig_atomic_t checkpoint_signalled = 0;
+pid_t checkpoint_writer = 0; // forked child writing the last checkpoint
+uint32_t checkpoint_binary_size;
+uint32_t checkpoint_binary_hash;
+
+
+void checkpoint_signal(int sig)
+{
+  checkpoint_signalled = 1;
+}
+
+
+int checkpoint_block_cmp(const void *a, const void *b) // by address, then by block index so the block reads see comes first
+{
+  uint32_t ia = *(const uint32_t *)a;
+  uint32_t ib = *(const uint32_t *)b;
+
+  if (mem_index[ia] != mem_index[ib])
+    return mem_index[ia] < mem_index[ib] ? -1 : 1;
+  return ia < ib ? -1 : (ia > ib);
+}
+
+
+void checkpoint_put_bytes(FILE *f, const uint8_t *data, uint32_t len) // run length encoded
+{
+  uint32_t literal = 0; // start of the pending literal bytes
+
+  for (uint32_t k = 0; k <= len;)
+  {
+    uint32_t repeat = 1;
+    while (k < len && k + repeat < len && data[k + repeat] == data[k])
+      repeat++;
+
+    if (k < len && repeat < CP_MIN_REPEAT)
+    {
+      k += repeat;
+      continue;
+    }
+
+    if (k > literal)
+    {
+      put_varint(f, (uint64_t)(k - literal) << 1);
+      fwrite(data + literal, 1, k - literal, f);
+    }
+
+    if (k == len)
+      break;
+
+    put_varint(f, (uint64_t)repeat << 1 | 1);
+    fputc(data[k], f);
+    k += repeat;
+    literal = k;
+  }
+}
+
+
+int checkpoint_get_bytes(FILE *f, uint8_t *data, uint32_t len)
+{
+  for (uint32_t k = 0; k < len;)
+  {
+    uint64_t token;
+    if (get_varint(f, &token) < 0 || (token >> 1) == 0 || (token >> 1) > len - k) // empty runs are never written
+      return -1;
+
+    uint32_t n = token >> 1;
+    if (token & 1)
+    {
+      int byte = fgetc(f);
+      if (byte == EOF)
+        return -1;
+      memset(data + k, byte, n);
+    }
+    else if (fread(data + k, 1, n, f) != n)
+      return -1;
+
+    k += n;
+  }
+
+  return 0;
+}
+
+
+int checkpoint_write(const char *path) // in the forked child: its memory is the copy-on-write view of the parent at fork time
+{
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+  FILE *f = fopen(tmp, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "!!! checkpoint: cannot open %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+
+  fwrite(CP_MAGIC, 1, 4, f);
+  put_varint(f, CP_VERSION);
+  put_varint(f, checkpoint_binary_size);
+  put_varint(f, checkpoint_binary_hash);
+
+  for (int i = 1; i < 32; i++)
+    put_varint(f, cpu.regs[i]);
+  put_varint(f, cpu.pc);
+  for (int i = 0; i < 32; i++)
+    put_varint(f, cpu.fregs[i]);
+  put_varint(f, cpu.fcsr);
+  put_varint(f, inst_count);
+  put_varint(f, timing_cycles);
+  put_varint(f, blk_queue_num);
+  put_varint(f, blk_queue_desc);
+  put_varint(f, blk_queue_avail);
+  put_varint(f, blk_queue_used);
+  put_varint(f, blk_last_avail);
+  put_varint(f, blk_status);
+
+  // mem blocks are in write order, sort them by address to find the runs
+  uint32_t *order = malloc((mem_ptr ? mem_ptr : 1) * sizeof(uint32_t));
+  uint8_t *run = malloc(mem_ptr ? mem_ptr : 1);
+  uint32_t count = 0;
+
+  for (uint32_t i = 0; i < mem_ptr; i++)
+  {
+    if (mem_index[i] >= code_mem_ptr) // blocks below are shadowed by code
+      order[count++] = i;
+  }
+  qsort(order, count, sizeof(uint32_t), checkpoint_block_cmp);
+
+  for (uint32_t k = 0; k < count;)
+  {
+    uint32_t addr = mem_index[order[k]];
+    uint32_t len = 0;
+
+    for (; k < count && mem_index[order[k]] - addr <= len; k++)
+    {
+      if (mem_index[order[k]] - addr == len) // duplicates of an address sort after the one reads see
+        run[len++] = mem_block[order[k]];
+    }
+
+    put_varint(f, addr);
+    put_varint(f, len);
+    checkpoint_put_bytes(f, run, len);
+  }
+  put_varint(f, 0);
+  put_varint(f, 0);
+
+  free(order);
+  free(run);
+
+  if (fclose(f) != 0 || rename(tmp, path) < 0)
+  {
+    fprintf(stderr, "!!! checkpoint: cannot write %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void checkpoint_take(void) // forks, the child saves while the guest keeps running in the parent
+{
+  if (checkpoint_writer) // only one at a time, the next one is taken when it's done
+  {
+    if (waitpid(checkpoint_writer, NULL, WNOHANG) == 0)
+      return;
+    checkpoint_writer = 0;
+  }
+
+  fp_fflags(); // fold the host's flags into fcsr before it is copied
+
+  pid_t pid = fork();
+
+  if (pid < 0)
+  {
+    fprintf(stderr, "!!! checkpoint: fork failed: %s\n", strerror(errno));
+    return;
+  }
+
+  if (pid == 0)
+    _exit(checkpoint_write(checkpoint_file) < 0 ? 1 : 0);
+
+  checkpoint_writer = pid;
+  checkpoint_signalled = 0;
+  if (checkpoint_every)
+    checkpoint_at = inst_count + checkpoint_every;
+
+  if (!silent)
+    printf("# checkpoint at instruction %"PRIu64" (pc 0x%"PRIx32")\n", inst_count, cpu.pc);
+}
+
+
+void checkpoint_update(void) // from handle_events()
+{
+  if (checkpoint_signalled || (checkpoint_every && inst_count >= checkpoint_at))
+    checkpoint_take();
+
+  uint64_t next = inst_count + CP_POLL_INTERVAL;
+  if (checkpoint_every && checkpoint_at < next)
+    next = checkpoint_at;
+  schedule_event(next);
+}
+
+
+void checkpoint_arm(const char *path, uint64_t every, uint32_t binary_size, uint32_t binary_hash)
+{
+  checkpoint_file = path;
+  checkpoint_every = every;
+  checkpoint_at = inst_count + every;
+  checkpoint_binary_size = binary_size;
+  checkpoint_binary_hash = binary_hash;
+
+  signal(SIGUSR1, checkpoint_signal);
+  schedule_event(0);
+}
+
+
+void checkpoint_finish(void) // let the last checkpoint reach the disk before the process exits
+{
+  if (checkpoint_writer)
+    waitpid(checkpoint_writer, NULL, 0);
+  checkpoint_writer = 0;
+}
+
+
+int checkpoint_resume(const char *path, uint32_t binary_size, uint32_t binary_hash)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+  {
+    fprintf(stderr, "!!! resume: cannot open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  char magic[4];
+  uint64_t version, size, hash;
+  if (fread(magic, 1, 4, f) != 4 || memcmp(magic, CP_MAGIC, 4) || get_varint(f, &version) < 0 || version != CP_VERSION
+    || get_varint(f, &size) < 0 || get_varint(f, &hash) < 0)
+  {
+    fprintf(stderr, "!!! resume: %s is not a checkpoint\n", path);
+    fclose(f);
+    return -1;
+  }
+
+  if (size != binary_size || hash != binary_hash)
+  {
+    fprintf(stderr, "!!! resume: %s was taken with a different binary\n", path);
+    fclose(f);
+    return -1;
+  }
+
+  uint64_t state[31 + 1 + 32 + 1 + 2 + 6]; // in the order checkpoint_write() puts them
+  for (int i = 0; i < sizeof(state) / sizeof(state[0]); i++)
+  {
+    if (get_varint(f, &state[i]) < 0)
+    {
+      fprintf(stderr, "!!! resume: %s is truncated\n", path);
+      fclose(f);
+      return -1;
+    }
+  }
+
+  uint64_t *s = state;
+  for (int i = 1; i < 32; i++)
+    cpu.regs[i] = *s++;
+  cpu.pc = *s++;
+  for (int i = 0; i < 32; i++)
+    cpu.fregs[i] = *s++;
+  cpu.fcsr = *s++;
+  inst_count = *s++;
+  timing_cycles = *s++;
+  blk_queue_num = *s++;
+  blk_queue_desc = *s++;
+  blk_queue_avail = *s++;
+  blk_queue_used = *s++;
+  blk_last_avail = *s++;
+  blk_status = *s++;
+
+  mem_ptr = 0; // runs don't overlap, so they are appended without lookups
+  for (;;)
+  {
+    uint64_t addr, len;
+    if (get_varint(f, &addr) < 0 || get_varint(f, &len) < 0 || len > MAX_MEM_BLOCKS - mem_ptr)
+    {
+      fprintf(stderr, "!!! resume: %s is truncated or too large\n", path);
+      fclose(f);
+      return -1;
+    }
+
+    if (len == 0)
+      break;
+
+    if (checkpoint_get_bytes(f, &mem_block[mem_ptr], len) < 0)
+    {
+      fprintf(stderr, "!!! resume: %s is truncated or corrupt\n", path);
+      fclose(f);
+      return -1;
+    }
+
+    for (uint32_t j = 0; j < len; j++)
+      mem_index[mem_ptr + j] = addr + j;
+    mem_ptr += len;
+  }
+
+  fclose(f);
+  fprintf(stderr, "resumed at instruction %"PRIu64", pc 0x%"PRIx32", %"PRIu32" bytes of memory\n", inst_count, cpu.pc, mem_ptr);
+  return 0;
+}
+
+
+// everything that must not be checked on every instruction runs here, see next_event
+void handle_events(void)
+{
+  next_event = UINT64_MAX;
+
+  if (run_result) // keep the event pending until execute() has returned
+  {
+    schedule_event(0);
+    return;
+  }
+
+  run_check_limits();
+
+  if (gdb_fd >= 0)
+  {
+    if (gdb_pending_stop[0])
+    {
+      char reason[sizeof(gdb_pending_stop)];
+      strcpy(reason, gdb_pending_stop);
+      gdb_pending_stop[0] = 0;
+      gdb_stop(reason);
+    }
+    else if (gdb_stepping)
+      gdb_stop("S05");
+    else
+      gdb_poll();
+  }
+
+  if (gdb_fd >= 0)
+    schedule_event(inst_count + GDB_POLL_INTERVAL);
+
+  if (trace_window)
+    trace_update();
+
+  if (trace_every)
+    trace_sample();
+
+  if (checkpoint_file)
+    checkpoint_update();
+
+  if (heat)
+    heat_update();
+}
+
+
+// ---- afl++ compatible edge coverage and persistent fuzzing ----
+
+#define AFL_MAP_SIZE 65536 // afl++ default MAP_SIZE
+#define AFL_FORKSRV_FD 198
+#define FUZZ_MAX_INPUT (1024 * 1024)
+
+uint8_t *afl_area = NULL; // afl's shared memory coverage map, NULL = not instrumenting
+uint32_t afl_prev_loc = 0;
+uint8_t afl_forkserver_active = 0;
+
+const char *fuzz_input = NULL; // file afl writes the current input to (@@), or "-" for stdin
+uint32_t fuzz_addr = 0x100000; // guest address the input is placed at, a0 = length, a1 = address
+uint32_t fuzz_iterations = 1000; // inputs per process in persistent mode
+
+uint32_t fuzz_snap_mem_ptr;
+uint32_t *fuzz_snap_index;
+uint8_t *fuzz_snap_block;
+cpu_t fuzz_snap_cpu;
+uint64_t fuzz_snap_inst_count;
+
+
+void afl_edge(uint32_t pc) // called on every control transfer (taken or not) with its target
+{
+  uint32_t cur = ((pc >> 2) * 0x9E3779B1) >> 16;
+  afl_area[(cur ^ afl_prev_loc) & (AFL_MAP_SIZE - 1)]++;
+  afl_prev_loc = (cur & (AFL_MAP_SIZE - 1)) >> 1;
+}
+
+
+int execute(void)
+{
+  while (1)
+  {
+    if (inst_count >= next_event) // faults, limits, debugger, trace windows, ... (never checked on the fast path)
+    {
+      handle_events();
+      if (run_result)
+        return run_result;
+    }
+
+    inst_count++;
+
+    cpu.regs[0] = 0;
+    //printf("reading instruction... ");
+
+    int old_silence = silent;
+    silent = 1;
+    uint32_t inst = mem_read_32(cpu.pc);
+    silent = old_silence;
+
+    if (timing)
+      timing_fetch(cpu.pc);
+
+    if (heat)
+      heat_access(cpu.pc, 4, HEAT_FETCH);
+
+
+#define BYTE_TO_BINARY_PATTERN "%c%c%c%c%c%c%c%c" // thx to William Whyte on stackoverflow
+#define BYTE_TO_BINARY(byte)  \
+  (byte & 0x80 ? '1' : '0'), \
+  (byte & 0x40 ? '1' : '0'), \
+  (byte & 0x20 ? '1' : '0'), \
+  (byte & 0x10 ? '1' : '0'), \
+  (byte & 0x08 ? '1' : '0'), \
+  (byte & 0x04 ? '1' : '0'), \
+  (byte & 0x02 ? '1' : '0'), \
+  (byte & 0x01 ? '1' : '0') 
+
+
+    if (!silent)
+    {
+      // a breakpoint patched in EBREAK, show what it replaced; a trace start / stop pc re-fetches after the trigger, the header comes then
+      breakpoint_t *bp = inst == INST_EBREAK ? breakpoint_find(cpu.pc) : NULL;
+      uint32_t shown = bp ? bp->orig : inst;
+
+      if (!bp || !(bp->owners & (BP_TRACE_ON | BP_TRACE_OFF)))
+        printf("\n[PC = 0x%"PRIx32", inst = %02"PRIx8" %02"PRIx8" %02"PRIx8" %02"PRIx8" ("BYTE_TO_BINARY_PATTERN""BYTE_TO_BINARY_PATTERN""BYTE_TO_BINARY_PATTERN""BYTE_TO_BINARY_PATTERN")] MWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMWMW\n", 
+        cpu.pc, (uint8_t)shown, (uint8_t)(shown >> 8), (uint8_t)(shown >> 16),(uint8_t)(shown >> 24), BYTE_TO_BINARY((uint8_t)shown>>24), BYTE_TO_BINARY(shown>>16), BYTE_TO_BINARY(shown>>8), BYTE_TO_BINARY(shown));
+    }
+        
+
+
+dispatch: ;
+    uint8_t opcode = inst & 0x7F;
+
+    uint8_t funct3 = (inst >> 12) & 0b111;
+    uint8_t funct7 = (inst >> 25) & 0b1111111;
+
+
+    switch (inst)
+    {
+      // case 0b00000000001000000000000001110011: // uret (wtf)
+      // case 0b00010000001000000000000001110011: // sret (wtf)
       // case 0b00110000001000000000000001110011: // mret (wtf)
       // {
       //   puts("some RET!!!");
@@ -349,7 +3100,8 @@ int main(int argc, char **argv)
                 uint32_t old = cpu.regs[rd];
                 cpu.regs[rd] = cpu.regs[rs1] + imm;
 
-                printf("OP: ADDI: _imm = %"PRIu32", imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", _imm, imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
+                if (!silent)
+                  printf("OP: ADDI: _imm = %"PRIu32", imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", _imm, imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
                 break;
               }
 
@@ -366,12 +3118,14 @@ int main(int argc, char **argv)
                 if (inst & 0b01000000000000000000000000000000) // xD SRAI
                 {
                   cpu.regs[rd] = cpu.regs[rs1] >> ((int32_t)imm);
-                  printf("OP: SRAI: imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
+                  if (!silent)
+                    printf("OP: SRAI: imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
                 }
                 else if (inst & 0) // SRLI
                 {
                   cpu.regs[rd] = cpu.regs[rs1] >> imm;
-                  printf("OP: SRLI: imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
+                  if (!silent)
+                    printf("OP: SRLI: imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
                 }
 
                 break;
@@ -388,7 +3142,8 @@ int main(int argc, char **argv)
                 uint32_t old = cpu.regs[rd];
 
                 cpu.regs[rd] = cpu.regs[rs1] >> imm;
-                printf("OP: SLLI: imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
+                if (!silent)
+                  printf("OP: SLLI: imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
 
                 break;
               }
@@ -407,7 +3162,8 @@ int main(int argc, char **argv)
                 uint32_t old = cpu.regs[rd];
                 cpu.regs[rd] = cpu.regs[rs1] & imm;
 
-                printf("OP: ANDI: _imm = %"PRIu32", imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", _imm, imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
+                if (!silent)
+                  printf("OP: ANDI: _imm = %"PRIu32", imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", _imm, imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
                 break;
               }
 
@@ -423,7 +3179,8 @@ int main(int argc, char **argv)
                 uint32_t old = cpu.regs[rd];
                 cpu.regs[rd] = cpu.regs[rs1] ^ imm;
 
-                printf("OP: ANDI: _imm = %"PRIu32", imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", _imm, imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
+                if (!silent)
+                  printf("OP: ANDI: _imm = %"PRIu32", imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", _imm, imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
                 break;
               }
 
@@ -439,7 +3196,8 @@ int main(int argc, char **argv)
                 uint32_t old = cpu.regs[rd];
                 cpu.regs[rd] = cpu.regs[rs1] | imm;
 
-                printf("OP: ORI: _imm = %"PRIu32", imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", _imm, imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
+                if (!silent)
+                  printf("OP: ORI: _imm = %"PRIu32", imm = %"PRIi32", rd = %s, rs1 = %s, x[rd](result) = %"PRIu32", x[rd](old) = %"PRIu32", x[rs1] = %"PRIu32"\n", _imm, imm, r2s(rd), r2s(rs1), cpu.regs[rd], old, cpu.regs[rs1]);
                 break;
               }
 
@@ -447,8 +3205,8 @@ int main(int argc, char **argv)
               default:
               {
                 printf("! unknown funct3 %"PRIu8" for opcode %"PRIu8"\n", funct3, opcode);
-                //return -1;
-                break;
+                return illegal_instruction();
+                //break;
               }
             }
 
@@ -471,12 +3229,24 @@ int main(int argc, char **argv)
                 
                 uint32_t addr = ((int32_t)cpu.regs[rs1]) + offset;
 
-                if (funct3 == 0b000) // SB
+                if (watchpoint_count)
+                  watch_check(addr, funct3 == 0b000 ? 1 : 4, 1);
+
+                if (timing)
+                  timing_data(addr);
+
+                if (heat)
+                  heat_access(addr, funct3 == 0b000 ? 1 : 4, HEAT_WRITE);
+
+                if (funct3 == 0b010 && blk_image && addr - BLK_BASE < BLK_REG_SPACE) // device register
+                  blk_write(addr - BLK_BASE, cpu.regs[rs2]);
+                else if (funct3 == 0b000) // SB
                   mem_write_8(addr, cpu.regs[rs2]);
                 else // SW
                   mem_write_32(addr, cpu.regs[rs2]);
 
-                printf("OP: SW/SB: offset = %"PRIi32", _offset = %"PRIu32", rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", addr = %"PRIx32"\n", offset, _offset, r2s(rs1), r2s(rs2), cpu.regs[rs1],cpu.regs[rs2], addr);
+                if (!silent)
+                  printf("OP: SW/SB: offset = %"PRIi32", _offset = %"PRIu32", rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", addr = %"PRIx32"\n", offset, _offset, r2s(rs1), r2s(rs2), cpu.regs[rs1],cpu.regs[rs2], addr);
 
                 break;
               }
@@ -502,8 +3272,8 @@ int main(int argc, char **argv)
               default:
               {
                 printf("! unknown funct3 %"PRIu8" for opcode %"PRIu8"\n", funct3, opcode);
-                //return -1;
-                break;
+                return illegal_instruction();
+                //break;
               }
             }
 
@@ -519,7 +3289,8 @@ int main(int argc, char **argv)
             int32_t imm = (((int32_t)_imm) << 0) >> 0;
 
             cpu.regs[rd] = imm;
-            printf("OP: LUI: rd = %s, imm = %"PRIi32", _imm = %"PRIu32"\n", r2s(rd), imm, _imm);
+            if (!silent)
+              printf("OP: LUI: rd = %s, imm = %"PRIi32", _imm = %"PRIu32"\n", r2s(rd), imm, _imm);
             break;
           }
 
@@ -548,8 +3319,19 @@ int main(int argc, char **argv)
 
                 uint32_t addr = (((int32_t)cpu.regs[rs1]) + offset);
                 uint32_t _val;
+
+                if (watchpoint_count)
+                  watch_check(addr, funct3 == 0b101 ? 2 : (funct3 == 0b010 ? 4 : 1), 0);
+
+                if (timing)
+                  timing_data(addr);
+
+                if (heat)
+                  heat_access(addr, funct3 == 0b101 ? 2 : (funct3 == 0b010 ? 4 : 1), HEAT_READ);
                 
-                if (funct3 == 0b010 || funct3 == 0b100) // LB / LBU
+                if (funct3 == 0b010 && blk_image && addr - BLK_BASE < BLK_REG_SPACE) // device register
+                  _val = blk_read(addr - BLK_BASE);
+                else if (funct3 == 0b010 || funct3 == 0b100) // LB / LBU
                   _val = mem_read_8(addr);
                 else if (funct3 == 0b101) // LHU
                   _val = mem_read_16(addr);
@@ -561,15 +3343,16 @@ int main(int argc, char **argv)
                 else // zero-extend for LBU
                   cpu.regs[rd] = ((_val << 0) >> 0); // z-e 2 0
                 
-                printf("OP: LW/LB: rd = %s, rs1 = %s, reg[rs1] = %"PRIu32", addr = %"PRIx32", _offset = %"PRIu32", offset = %"PRIi32", _val = %"PRIu32", reg[rd] = %"PRIi32" (unsigned = %"PRIu32")\n", r2s(rd), r2s(rs1), cpu.regs[rs1], addr, _offset, offset, _val, cpu.regs[rd], cpu.regs[rd]);
+                if (!silent)
+                  printf("OP: LW/LB: rd = %s, rs1 = %s, reg[rs1] = %"PRIu32", addr = %"PRIx32", _offset = %"PRIu32", offset = %"PRIi32", _val = %"PRIu32", reg[rd] = %"PRIi32" (unsigned = %"PRIu32")\n", r2s(rd), r2s(rs1), cpu.regs[rs1], addr, _offset, offset, _val, cpu.regs[rd], cpu.regs[rd]);
                 break;
               }
 
               default:
               {
                 printf("! unknown funct3 %"PRIu8" for opcode %"PRIu8"\n", funct3, opcode);
-                //return -1;
-                break;
+                return illegal_instruction();
+                //break;
               }
             }
 
@@ -601,14 +3384,20 @@ int main(int argc, char **argv)
                 
                 if (rd == 0 && offset == 0 && new_pc == 0 && rs1_val == 0) // RET, with no 'valid' return address
                 {
-                  printf("# program exited with code: TODO\n");
-                  //printf("# program exited with code: %"PRIi32"\n", cpu.regs[10]); ???
-                  return 0;
+                  printf("# program exited with code: %"PRIi32"\n", cpu.regs[10]);
+                  return cpu.regs[10];
                 }
 
                 cpu.pc = new_pc;
 
-                printf("OP: JALR (RET): rd = %s, rs1 = %s, reg[rs1] = 0x%"PRIx32", _offset = %"PRIu32", offset = %"PRIi32", next_address & reg[rd] = 0x%"PRIx32", pc = 0x%"PRIx32"\n", 
+                if (afl_area)
+                  afl_edge(cpu.pc);
+
+                if (timing)
+                  timing_jump(rd, rs1, cpu.pc);
+
+                if (!silent)
+                  printf("OP: JALR (RET): rd = %s, rs1 = %s, reg[rs1] = 0x%"PRIx32", _offset = %"PRIu32", offset = %"PRIi32", next_address & reg[rd] = 0x%"PRIx32", pc = 0x%"PRIx32"\n", 
                 r2s(rd), r2s(rs1), cpu.regs[rs1], _offset, offset, next_address, cpu.pc);
 
                 continue; // !!!!!!!!!!!!!!! (so pc will NOT be +4'd)
@@ -618,7 +3407,7 @@ int main(int argc, char **argv)
               default:
               {
                 printf("! unknown funct3 %"PRIu8" for opcode %"PRIu8"\n", funct3, opcode);
-                return -1;
+                return illegal_instruction();
                 //break;
               }
             }
@@ -655,7 +3444,8 @@ int main(int argc, char **argv)
                     if (rs1_val != rs2_val)
                       branch = 1;
 
-                    printf("OP: BNE: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
+                    if (!silent)
+                      printf("OP: BNE: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
                       r2s(rs1), r2s(rs2), rs1_val, rs2_val, branch);
                     
                     break;
@@ -666,7 +3456,8 @@ int main(int argc, char **argv)
                     if ((int32_t)rs1_val < (int32_t)rs2_val)
                       branch = 1;
 
-                    printf("OP: BLT: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
+                    if (!silent)
+                      printf("OP: BLT: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
                       r2s(rs1), r2s(rs2), rs1_val, rs2_val, branch);
                     
                     break;
@@ -677,7 +3468,8 @@ int main(int argc, char **argv)
                     if (rs1_val == rs2_val)
                       branch = 1;
 
-                    printf("OP: BEQ: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
+                    if (!silent)
+                      printf("OP: BEQ: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
                       r2s(rs1), r2s(rs2), rs1_val, rs2_val, branch);
                     
                     break;
@@ -688,7 +3480,8 @@ int main(int argc, char **argv)
                     if ((int32_t)rs1_val > (int32_t)rs2_val)
                       branch = 1;
 
-                    printf("OP: BGE: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
+                    if (!silent)
+                      printf("OP: BGE: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
                       r2s(rs1), r2s(rs2), rs1_val, rs2_val, branch);
                     
                     break;
@@ -699,7 +3492,8 @@ int main(int argc, char **argv)
                     if (rs1_val > rs2_val)
                       branch = 1;
 
-                    printf("OP: BGEU: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
+                    if (!silent)
+                      printf("OP: BGEU: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
                       r2s(rs1), r2s(rs2), rs1_val, rs2_val, branch);
                     
                     break;
@@ -710,7 +3504,8 @@ int main(int argc, char **argv)
                     if (rs1_val < rs2_val)
                       branch = 1;
 
-                    printf("OP: BLTU: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
+                    if (!silent)
+                      printf("OP: BLTU: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? %i\n", 
                       r2s(rs1), r2s(rs2), rs1_val, rs2_val, branch);
                     
                     break;
@@ -719,12 +3514,16 @@ int main(int argc, char **argv)
                   default:
                   {
                     fprintf(stderr, "dev forgot to add case here...\n");
-                    return -1;
+                    return illegal_instruction();
                   }
                 }
                 
                 if (!branch)
+                {
+                  if (afl_area)
+                    afl_edge(cpu.pc + 4);
                   break;
+                }
                 
                 // imm[20|10:1|11|19:12]   o_o'
                 // offset[12|10:5] ... offset[4:1|11]   o.o
@@ -733,6 +3532,9 @@ int main(int argc, char **argv)
 
                 cpu.pc += offset;
 
+                if (afl_area)
+                  afl_edge(cpu.pc);
+
                 continue; // !!!!!!!!!!!!!!! (so pc will NOT be +4'd)
               }
 
@@ -749,7 +3551,8 @@ int main(int argc, char **argv)
 
                 if (rs1_val == rs2_val)
                 {
-                  printf("OP: BNE: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? NO\n", r2s(rs1), r2s(rs2), rs1_val, rs2_val);
+                  if (!silent)
+                    printf("OP: BNE: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? NO\n", r2s(rs1), r2s(rs2), rs1_val, rs2_val);
                   break;
                 }
                 
@@ -759,7 +3562,8 @@ int main(int argc, char **argv)
 
                 cpu.pc += offset;
 
-                printf("OP: BNE: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", _offset = %"PRIu32", offset = %"PRIi32", branching? YES\n", r2s(rs1), r2s(rs2), rs1_val, rs2_val, _offset, offset);
+                if (!silent)
+                  printf("OP: BNE: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", _offset = %"PRIu32", offset = %"PRIi32", branching? YES\n", r2s(rs1), r2s(rs2), rs1_val, rs2_val, _offset, offset);
                 continue; // !!!!!!!!!!!!!!! (so pc will NOT be +4'd)
               }
 
@@ -776,7 +3580,8 @@ int main(int argc, char **argv)
 
                 if (rs1_val != rs2_val)
                 {
-                  printf("OP: BEQ: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? NO\n", r2s(rs1), r2s(rs2), rs1_val, rs2_val);
+                  if (!silent)
+                    printf("OP: BEQ: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", branching? NO\n", r2s(rs1), r2s(rs2), rs1_val, rs2_val);
                   break;
                 }
                 
@@ -786,7 +3591,8 @@ int main(int argc, char **argv)
 
                 cpu.pc += offset;
 
-                printf("OP: BEQ: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", _offset = %"PRIu32", offset = %"PRIi32", branching? YES\n", r2s(rs1), r2s(rs2), rs1_val, rs2_val, _offset, offset);
+                if (!silent)
+                  printf("OP: BEQ: rs1 = %s, rs2 = %s, reg[rs1] = %"PRIu32", reg[rs2] = %"PRIu32", _offset = %"PRIu32", offset = %"PRIi32", branching? YES\n", r2s(rs1), r2s(rs2), rs1_val, rs2_val, _offset, offset);
                 continue; // !!!!!!!!!!!!!!! (so pc will NOT be +4'd)
               }
 
@@ -800,7 +3606,7 @@ int main(int argc, char **argv)
               default:
               {
                 printf("! unknown funct3 %"PRIu8" for opcode %"PRIu8"\n", funct3, opcode);
-                return -1;
+                return illegal_instruction();
                 //break;
               }
             }
@@ -818,7 +3624,8 @@ int main(int argc, char **argv)
             uint32_t pc = (((int32_t)cpu.pc) + imm);
             cpu.regs[rd] = pc;
 
-            printf("OP: AUIPC: rd = %s, imm = %"PRIi32", _imm = %"PRIu32", reg[rd] = %"PRIu32"\n", r2s(rd), imm, _imm, pc);
+            if (!silent)
+              printf("OP: AUIPC: rd = %s, imm = %"PRIi32", _imm = %"PRIu32", reg[rd] = %"PRIu32"\n", r2s(rd), imm, _imm, pc);
             break;
           }
 
@@ -834,7 +3641,14 @@ int main(int argc, char **argv)
             cpu.regs[rd] = cpu.pc + 4; // write return address into reg rd
             cpu.pc = ((int32_t)cpu.pc) + imm;
 
-            printf("OP: JAL: rd = %s, _imm = %"PRIu32", imm = %"PRIi32", pc(new) = 0x%"PRIx32", reg[rd] = %"PRIx32"\n", 
+            if (afl_area)
+              afl_edge(cpu.pc);
+
+            if (timing)
+              timing_jump(rd, 0, cpu.pc);
+
+            if (!silent)
+              printf("OP: JAL: rd = %s, _imm = %"PRIu32", imm = %"PRIi32", pc(new) = 0x%"PRIx32", reg[rd] = %"PRIx32"\n", 
             r2s(rd), _imm, imm, cpu.pc, cpu.regs[rd]);
 
             continue; // !!!!!!!!!!!!!!! (so pc will NOT be +4'd)
@@ -855,20 +3669,22 @@ int main(int argc, char **argv)
                 {
                   cpu.regs[rd] = cpu.regs[rs1] - cpu.regs[rs2];
 
-                  printf("OP: SUB: rd = %s, rs1 = %s, reg[rs1] = %"PRIu32", rs2 = %s, reg[rs2] = %"PRIu32", reg[rd] = %"PRIx32"\n", 
+                  if (!silent)
+                    printf("OP: SUB: rd = %s, rs1 = %s, reg[rs1] = %"PRIu32", rs2 = %s, reg[rs2] = %"PRIu32", reg[rd] = %"PRIx32"\n", 
                     r2s(rd), r2s(rs1), cpu.regs[rs1], r2s(rs2), cpu.regs[rs2], cpu.regs[rd]);
                 }
                 else if (!((inst >> 30) & 1)) // ADD
                 {
                   cpu.regs[rd] = cpu.regs[rs1] + cpu.regs[rs2];
 
-                  printf("OP: ADD: rd = %s, rs1 = %s, reg[rs1] = %"PRIu32", rs2 = %s, reg[rs2] = %"PRIu32", reg[rd] = %"PRIx32"\n", 
+                  if (!silent)
+                    printf("OP: ADD: rd = %s, rs1 = %s, reg[rs1] = %"PRIu32", rs2 = %s, reg[rs2] = %"PRIu32", reg[rd] = %"PRIx32"\n", 
                     r2s(rd), r2s(rs1), cpu.regs[rs1], r2s(rs2), cpu.regs[rs2], cpu.regs[rd]);
                 }
                 else 
                 {
                   printf("! unknown function for funct3 %"PRIx8" for opcode %"PRIx8" (instruction: %"PRIx32")\n", funct3, opcode, inst);
-                  return -1;
+                  return illegal_instruction();
                 }
 
                 break;
@@ -877,7 +3693,7 @@ int main(int argc, char **argv)
               default:
               {
                 printf("! unknown funct3 %"PRIu8" for opcode %"PRIu8"\n", funct3, opcode);
-                return -1;
+                return illegal_instruction();
                 //break;
               }
             }
@@ -886,10 +3702,189 @@ int main(int argc, char **argv)
           }
 
 
+          case 0b0001011: // custom-0: MEMCPY, MEMSET, MEMMOVE on the host (a0 = dst, a1 = src / fill byte, a2 = length)
+          {
+            uint32_t dst = cpu.regs[10];
+            uint32_t src = cpu.regs[11];
+            uint32_t len = cpu.regs[12];
+
+            if (funct3 == 0b000 || funct3 == 0b010) // MEMCPY, MEMMOVE
+            {
+              if (watchpoint_count)
+                watch_check(src, len, 0);
+              if (timing)
+                timing_data_range(src, len);
+              if (heat)
+                heat_access(src, len, HEAT_READ);
+
+              mem_copy(dst, src, len);
+            }
+            else if (funct3 == 0b001) // MEMSET
+              mem_write_range(dst, NULL, src, len);
+            else
+            {
+              printf("! unknown funct3 %"PRIu8" for opcode %"PRIu8"\n", funct3, opcode);
+              return illegal_instruction();
+            }
+
+            if (watchpoint_count)
+              watch_check(dst, len, 1);
+            if (timing)
+              timing_data_range(dst, len);
+            if (heat)
+              heat_access(dst, len, HEAT_WRITE);
+
+            if (!silent)
+              printf("OP: %s: dst = 0x%"PRIx32", src = 0x%"PRIx32", len = %"PRIu32"\n", funct3 == 0b001 ? "MEMSET" : (funct3 == 0b000 ? "MEMCPY" : "MEMMOVE"), dst, src, len);
+            break;
+          }
+
+
+          case 0b0000111: // FLW
+          case 0b0100111: // FSW
+          {
+            if (funct3 != 0b010)
+            {
+              printf("! unknown funct3 %"PRIu8" for opcode %"PRIu8"\n", funct3, opcode);
+              return illegal_instruction();
+            }
+
+            uint8_t rs1 = (inst >> 15) & 0b11111;
+            uint8_t is_store = opcode == 0b0100111;
+            uint8_t freg = is_store ? (inst >> 20) & 0b11111 : (inst >> 7) & 0b11111;
+
+            uint32_t _offset = is_store ? ((inst >> 7) & 0b11111) | (((inst >> 25) & 0b1111111) << 5) : (inst >> 20) & 0b111111111111;
+            int32_t offset = (((int32_t)_offset) << (32 - 12)) >> (32 - 12); // s-e 2 12
+
+            uint32_t addr = ((int32_t)cpu.regs[rs1]) + offset;
+
+            if (watchpoint_count)
+              watch_check(addr, 4, is_store);
+
+            if (timing)
+              timing_data(addr);
+
+            if (heat)
+              heat_access(addr, 4, is_store ? HEAT_WRITE : HEAT_READ);
+
+            if (is_store)
+              mem_write_32(addr, cpu.fregs[freg]);
+            else
+              cpu.fregs[freg] = mem_read_32(addr);
+
+            if (!silent)
+              printf("OP: %s: %s = %s, rs1 = %s, offset = %"PRIi32", addr = %"PRIx32", val = %g (0x%08"PRIx32")\n", is_store ? "FSW" : "FLW", is_store ? "rs2" : "rd", f2s(freg), r2s(rs1), offset, addr, f32_trace(cpu.fregs[freg]), cpu.fregs[freg]);
+            break;
+          }
+
+
+          case 0b1010011: // OP-FP: FADD.S, FCVT.W.S, FMV.X.W, etc.
+          {
+            if (fp_op(inst) < 0)
+            {
+              printf("! unknown OP-FP instruction 0x%"PRIx32"\n", inst);
+              return illegal_instruction();
+            }
+            break;
+          }
+
+
+          case 0b1000011: // FMADD.S
+          case 0b1000111: // FMSUB.S
+          case 0b1001011: // FNMSUB.S
+          case 0b1001111: // FNMADD.S
+          {
+            if (fp_fma(inst) < 0)
+            {
+              printf("! unknown fused multiply-add instruction 0x%"PRIx32"\n", inst);
+              return illegal_instruction();
+            }
+            break;
+          }
+
+
+          case 0b1110011: // EBREAK, ECALL, etc.
+          {
+            if (funct3 != 0b000 && funct3 != 0b100) // CSRRW, CSRRS, CSRRC and their immediate forms
+            {
+              uint8_t rd = (inst >> 7) & 0b11111;
+              uint8_t rs1 = (inst >> 15) & 0b11111;
+              uint16_t csr = inst >> 20;
+              uint32_t src = funct3 & 0b100 ? rs1 : cpu.regs[rs1]; // uimm for the I forms
+              uint8_t op = funct3 & 0b011;
+              uint32_t old = 0;
+
+              // CSRRW with rd = x0 doesn't read, CSRRS/C with a zero source don't write
+              if ((op != 0b01 || rd != 0) && csr_read(csr, &old, 1) < 0)
+              {
+                printf("! unknown csr 0x%03"PRIx16"\n", csr);
+                return illegal_instruction();
+              }
+
+              if ((op == 0b01 || rs1 != 0) && csr_write(csr, op == 0b01 ? src : (op == 0b10 ? old | src : old & ~src)) < 0)
+              {
+                printf("! csr 0x%03"PRIx16" is not writable\n", csr);
+                return illegal_instruction();
+              }
+
+              if (rd != 0)
+                cpu.regs[rd] = old;
+
+              if (!silent)
+                printf("OP: CSR: funct3 = %"PRIu8", csr = 0x%03"PRIx16", rd = %s, rs1/uimm = %"PRIu8", src = 0x%"PRIx32", x[rd] = 0x%"PRIx32"\n", funct3, csr, r2s(rd), rs1, src, old);
+              break;
+            }
+
+            if (inst == INST_EBREAK)
+            {
+              breakpoint_t *bp = breakpoint_find(cpu.pc);
+
+              if (bp && (bp->owners & (BP_TRACE_ON | BP_TRACE_OFF))) // trace start / stop pc, fires before the instruction runs
+              {
+                trace_trigger(bp);
+                bp = breakpoint_find(cpu.pc);
+
+                if (!bp || !(bp->owners & BP_GDB))
+                {
+                  gdb_step_over_bp = 0;
+                  inst_count--; // not retired
+                  continue; // !!!!!!!!!!!!!!! (re-fetch the restored instruction)
+                }
+              }
+
+              if (bp && gdb_step_over_bp) // resumed on this breakpoint, run the instruction it replaced
+              {
+                gdb_step_over_bp = 0;
+                inst = bp->orig;
+                goto dispatch;
+              }
+
+              if (gdb_fd >= 0)
+              {
+                if (!silent)
+                  printf("OP: EBREAK: pc = 0x%"PRIx32"%s\n", cpu.pc, bp ? " (breakpoint)" : "");
+
+                if (!bp) // guest's own ebreak, report it and step over it on resume
+                {
+                  gdb_stop("S05");
+                  break;
+                }
+
+                inst_count--; // not retired
+                gdb_stop("T05swbreak:;");
+                continue; // !!!!!!!!!!!!!!! (re-fetch at the same pc)
+              }
+            }
+
+            printf("! unknown SYSTEM instruction 0x%"PRIx32"\n", inst);
+            return illegal_instruction();
+          }
+
+
           default:
           {
             printf("unknown opcode 0x%"PRIx8" / %"PRIu8" / "BYTE_TO_BINARY_PATTERN"\n", opcode, opcode, BYTE_TO_BINARY(((uint8_t)((opcode >> 2) & 0b11111))));
-            return -1;
+            return illegal_instruction();
             //break;
           }
         }
@@ -901,6 +3896,417 @@ int main(int argc, char **argv)
     cpu.pc += 4;
   }
 
+}
+
+
+void afl_setup(void)
+{
+  const char *shm_id = getenv("__AFL_SHM_ID");
+  if (!shm_id)
+  {
+    fprintf(stderr, "fuzz: __AFL_SHM_ID not set, running without coverage\n");
+    return;
+  }
+
+  void *area = shmat(atoi(shm_id), NULL, 0);
+  if (area == (void *)-1)
+  {
+    fprintf(stderr, "!!! fuzz: shmat failed: %s\n", strerror(errno));
+    exit(-1);
+  }
+
+  afl_area = area;
+  afl_area[0] = 1; // let afl know the target is instrumented
+}
+
+
+void afl_forkserver(void) // returns in the child (or right away when not started by afl-fuzz)
+{
+  uint32_t msg = 0;
+  if (write(AFL_FORKSRV_FD + 1, &msg, 4) != 4)
+    return;
+
+  afl_forkserver_active = 1;
+  pid_t child = -1;
+  uint8_t child_stopped = 0;
+
+  while (1)
+  {
+    uint32_t was_killed;
+    if (read(AFL_FORKSRV_FD, &was_killed, 4) != 4)
+      exit(0);
+
+    int status;
+    if (child_stopped && was_killed) // afl timed out the stopped child, start over
+    {
+      child_stopped = 0;
+      waitpid(child, &status, 0);
+    }
+
+    if (!child_stopped)
+    {
+      child = fork();
+      if (child < 0)
+        exit(-1);
+
+      if (!child)
+      {
+        close(AFL_FORKSRV_FD);
+        close(AFL_FORKSRV_FD + 1);
+        return;
+      }
+    }
+    else // persistent mode: wake the child up for the next input
+    {
+      kill(child, SIGCONT);
+      child_stopped = 0;
+    }
+
+    if (write(AFL_FORKSRV_FD + 1, &child, 4) != 4)
+      exit(0);
+
+    if (waitpid(child, &status, fuzz_iterations > 1 ? WUNTRACED : 0) < 0)
+      exit(-1);
+
+    if (WIFSTOPPED(status))
+      child_stopped = 1;
+
+    if (write(AFL_FORKSRV_FD + 1, &status, 4) != 4)
+      exit(0);
+  }
+}
+
+
+void fuzz_snapshot(void)
+{
+  fuzz_snap_mem_ptr = mem_ptr;
+  fuzz_snap_index = malloc(mem_ptr * sizeof(uint32_t));
+  fuzz_snap_block = malloc(mem_ptr);
+  memcpy(fuzz_snap_index, mem_index, mem_ptr * sizeof(uint32_t));
+  memcpy(fuzz_snap_block, mem_block, mem_ptr);
+  fuzz_snap_cpu = cpu;
+  fuzz_snap_inst_count = inst_count;
+}
+
+
+void fuzz_restore(void)
+{
+  mem_ptr = fuzz_snap_mem_ptr;
+  memcpy(mem_index, fuzz_snap_index, mem_ptr * sizeof(uint32_t));
+  memcpy(mem_block, fuzz_snap_block, mem_ptr);
+  cpu = fuzz_snap_cpu;
+  feclearexcept(FE_ALL_EXCEPT); // flags of the last iteration aren't in fcsr yet
+  run_result = 0;
+
+  // instruction budget and timeout are per input
+  inst_count = fuzz_snap_inst_count;
+  if (run_timeout_ns)
+    run_deadline_ns = run_now_ns() + run_timeout_ns;
+
+  next_event = UINT64_MAX;
+  schedule_event(0); // handle_events() reschedules whatever is still pending
+}
+
+
+void fuzz_load_input(void)
+{
+  static uint8_t input[FUZZ_MAX_INPUT];
+  size_t len;
+
+  if (!strcmp(fuzz_input, "-"))
+  {
+    len = fread(input, 1, sizeof(input), stdin);
+    clearerr(stdin);
+  }
+  else
+  {
+    FILE *f = fopen(fuzz_input, "rb");
+    if (!f)
+    {
+      fprintf(stderr, "!!! fuzz: cannot open input %s\n", fuzz_input);
+      exit(-1);
+    }
+    len = fread(input, 1, sizeof(input), f);
+    fclose(f);
+  }
+
+  mem_store_range(fuzz_addr, input, 0, len);
+
+  cpu.regs[10] = len;
+  cpu.regs[11] = fuzz_addr;
+}
+
+
+int fuzz(void) // runs inputs until fuzz_iterations are done, guest faults crash the process so afl records them
+{
+  afl_setup();
+  afl_forkserver();
+
+  uint32_t iterations = afl_forkserver_active ? fuzz_iterations : 1;
+  fuzz_snapshot();
+
+  int ret = 0;
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    if (i)
+    {
+      raise(SIGSTOP); // done with this input, the forkserver continues us for the next one
+      fuzz_restore();
+    }
+
+    afl_prev_loc = 0;
+    fuzz_load_input();
+
+    ret = execute();
+    if (run_result == RESULT_FAULT || run_result == RESULT_ILLEGAL)
+      abort();
+  }
+
+  return ret;
+}
+
+
+void usage(const char *argv0)
+{
+  fprintf(stderr, "usage: %s [options] <binary file>\n", argv0);
+  fprintf(stderr, "  --gdb <port|socket path>   wait for gdb on a local tcp port or unix socket\n");
+  fprintf(stderr, "  --silent                   no per instruction trace\n");
+  fprintf(stderr, "  --max-instructions <n>     stop with %d after n instructions\n", RESULT_TIMEOUT);
+  fprintf(stderr, "  --timeout <seconds>        stop with %d after this much wall clock time\n", RESULT_TIMEOUT);
+  fprintf(stderr, "  --trace-from <n>           trace only from instruction count n on ...\n");
+  fprintf(stderr, "  --trace-to <n>             ... up to instruction count n\n");
+  fprintf(stderr, "  --trace-pc <pc>[,<pc>]     trace from the first execution of a pc (up to the second pc)\n");
+  fprintf(stderr, "  --trace-store <addr>       trace from the first store to addr on\n");
+  fprintf(stderr, "  --trace-every <n>          trace every nth instruction\n");
+  fprintf(stderr, "  --record <file>            log nondeterministic inputs to file\n");
+  fprintf(stderr, "  --replay <file>            feed a recorded log back in\n");
+  fprintf(stderr, "  --checkpoint <file>        save the machine to file on SIGUSR1 ...\n");
+  fprintf(stderr, "  --checkpoint-every <n>     ... and every n instructions\n");
+  fprintf(stderr, "  --resume <file>            continue from a checkpoint\n");
+  fprintf(stderr, "  --icache <size,ways,line>  model an instruction cache, report cycles at exit\n");
+  fprintf(stderr, "  --dcache <size,ways,line>  model a data cache, report cycles at exit\n");
+  fprintf(stderr, "  --miss-latency <cycles>    cache miss penalty (default %"PRIu32")\n", miss_latency);
+  fprintf(stderr, "  --blk <image file>         virtio style block device at 0x%"PRIx32", reads and writes go to the file\n", BLK_BASE);
+  fprintf(stderr, "  --heatmap <file>           count accesses per page, write them as csv (or json for *.json) at exit\n");
+  fprintf(stderr, "  --heatmap-page <bytes>     page size (default %u)\n", 1u << heat_page_shift);
+  fprintf(stderr, "  --heatmap-line <bytes>     also count per line of this size\n");
+  fprintf(stderr, "  --heatmap-window <n>       instructions per working set window (default %"PRIu64")\n", heat_window_len);
+  fprintf(stderr, "  --fuzz <input file|->      run under afl-fuzz (persistent, coverage via __AFL_SHM_ID)\n");
+  fprintf(stderr, "  --fuzz-addr <addr>         guest address of the fuzz input (default 0x%"PRIx32")\n", fuzz_addr);
+  fprintf(stderr, "  --fuzz-iterations <n>      inputs per process in persistent mode (default %"PRIu32")\n", fuzz_iterations);
+}
+
+
+int main(int argc, char **argv)
+{
+  const char *binary_file = NULL;
+  const char *gdb_where = NULL;
+  int stay_silent = 0;
+  double timeout = 0;
+  const char *record_file = NULL;
+  const char *replay_file = NULL;
+  const char *blk_file = NULL;
+  const char *resume_file = NULL;
+  const char *cp_file = NULL;
+  uint64_t cp_every = 0;
+
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--gdb") && i + 1 < argc)
+      gdb_where = argv[++i];
+    else if (!strcmp(argv[i], "--icache") && i + 1 < argc)
+    {
+      if (cache_config(&icache, argv[++i]) < 0)
+      {
+        usage(argv[0]);
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[i], "--dcache") && i + 1 < argc)
+    {
+      if (cache_config(&dcache, argv[++i]) < 0)
+      {
+        usage(argv[0]);
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[i], "--miss-latency") && i + 1 < argc)
+      miss_latency = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--trace-from") && i + 1 < argc)
+    {
+      trace_from = strtoull(argv[++i], NULL, 0);
+      trace_window = 1;
+    }
+    else if (!strcmp(argv[i], "--trace-to") && i + 1 < argc)
+    {
+      trace_to = strtoull(argv[++i], NULL, 0);
+      trace_window = 1;
+    }
+    else if (!strcmp(argv[i], "--trace-pc") && i + 1 < argc)
+    {
+      char *end;
+      trace_start_pc = strtoul(argv[++i], &end, 0);
+      if (*end == ',')
+        trace_stop_pc = strtoul(end + 1, NULL, 0);
+    }
+    else if (!strcmp(argv[i], "--trace-store") && i + 1 < argc)
+      trace_store_addr = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--trace-every") && i + 1 < argc)
+      trace_every = strtoull(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+      record_file = argv[++i];
+    else if (!strcmp(argv[i], "--blk") && i + 1 < argc)
+      blk_file = argv[++i];
+    else if (!strcmp(argv[i], "--heatmap") && i + 1 < argc)
+      heat_file = argv[++i];
+    else if (!strcmp(argv[i], "--heatmap-page") && i + 1 < argc)
+    {
+      if (heat_shift(argv[++i], &heat_page_shift) < 0)
+        return -1;
+    }
+    else if (!strcmp(argv[i], "--heatmap-line") && i + 1 < argc)
+    {
+      if (heat_shift(argv[++i], &heat_line_shift) < 0)
+        return -1;
+    }
+    else if (!strcmp(argv[i], "--heatmap-window") && i + 1 < argc)
+    {
+      heat_window_len = strtoull(argv[++i], NULL, 0);
+      if (!heat_window_len)
+      {
+        fprintf(stderr, "!!! heatmap: the window must be at least one instruction\n");
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc)
+      cp_file = argv[++i];
+    else if (!strcmp(argv[i], "--checkpoint-every") && i + 1 < argc)
+      cp_every = strtoull(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--resume") && i + 1 < argc)
+      resume_file = argv[++i];
+    else if (!strcmp(argv[i], "--replay") && i + 1 < argc)
+      replay_file = argv[++i];
+    else if (!strcmp(argv[i], "--max-instructions") && i + 1 < argc)
+      run_max_instructions = strtoull(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--timeout") && i + 1 < argc)
+      timeout = strtod(argv[++i], NULL);
+    else if (!strcmp(argv[i], "--silent"))
+      stay_silent = 1;
+    else if (!strcmp(argv[i], "--fuzz") && i + 1 < argc)
+      fuzz_input = argv[++i];
+    else if (!strcmp(argv[i], "--fuzz-addr") && i + 1 < argc)
+      fuzz_addr = strtoul(argv[++i], NULL, 0);
+    else if (!strcmp(argv[i], "--fuzz-iterations") && i + 1 < argc)
+      fuzz_iterations = strtoul(argv[++i], NULL, 0);
+    else if (argv[i][0] != '-' && !binary_file)
+      binary_file = argv[i];
+    else
+    {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (!binary_file)
+  {
+    usage(argv[0]);
+    return -1;
+  }
+  fprintf(stderr, "binary file: %s\n", binary_file);
+
+  //meminit(cpu, sizeof(cpu));
+  uint32_t cpu_size = sizeof(cpu_t);
+  memset(&cpu, 0, cpu_size);
+
+
+  //printf("cpu size = %"PRIu32"\n", cpu_size);
+
+  FILE *f = fopen(binary_file, "r");
+
+  if (!f)
+    return -1;
+
+
+  fseek(f, 0L, SEEK_END);
+  size_t file_size = ftell(f);
+  rewind(f);
+
+  if (file_size == 0 || file_size > UINT32_MAX)
+  {
+    fprintf(stderr, "!!! binary file has a size of %zu bytes\n", file_size);
+    return -1;
+  }
+
+  printf("mapping %zu bytes of binary...\n", file_size);
+
+  void *binary = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(f), 0);
+  fclose(f);
+
+  if (binary == MAP_FAILED)
+  {
+    fprintf(stderr, "!!! cannot map binary: %s\n", strerror(errno));
+    return -1;
+  }
+
+  code_mem = binary;
+  uint32_t x = file_size;
+
+  silent = 1;
+  uint32_t binary_hash = fnv1a(code_mem, x);
+  
+  // for (uint32_t i = 0; i < x; i+=4)
+  //   printf("0x%02"PRIx32" = %02"PRIx8" %02"PRIx8" %02"PRIx8" %02"PRIx8"\n", i, mem_read_8(i), mem_read_8(i+1), mem_read_8(i+2), mem_read_8(i+3));
+  silent = stay_silent || fuzz_input;
+
+
+  code_mem_ptr = x;
+
+  //printf("mem_ptr now %"PRIu32"\n", mem_ptr);
+
+  
+  // go :) - NOTE: must be platform independent at this point:
+  cpu.pc = 0;
+  //cpu.regs[2] = 0x10000; // set stack pointer to some smaller value than 0-1 ;)
+  mem_write_8_always_add_memblock(cpu.regs[2], 0); // = return address, which is known and is 0x0  (tell our software memory system to know the stack!)
+
+  if (resume_file && checkpoint_resume(resume_file, x, binary_hash) < 0)
+    return -1;
+
+
+  if (blk_file && blk_open(blk_file, !replay_file) < 0) // a replay leaves the image as the recording found it
+    return -1;
+
+  uint32_t image_hash = blk_image ? fnv1a(blk_image, blk_size) : 0;
+  if (record_file && rr_open(record_file, 0, x, binary_hash, blk_size, image_hash) < 0)
+    return -1;
+  if (replay_file && rr_open(replay_file, 1, x, binary_hash, blk_size, image_hash) < 0)
+    return -1;
+
+  if (trace_arm() < 0)
+    return -1;
+
+  if (timeout > 0)
+  {
+    run_timeout_ns = timeout * 1e9;
+    run_deadline_ns = run_now_ns() + run_timeout_ns;
+  }
+  if (run_max_instructions || run_deadline_ns)
+    schedule_event(0);
+
+  if (cp_file)
+    checkpoint_arm(cp_file, cp_every, x, binary_hash);
+
+  if (heat_file)
+    heat_arm();
+
+  if (gdb_where && gdb_listen(gdb_where) < 0)
+    return -1;
+
+  puts("executing!");
+
+
+  feclearexcept(FE_ALL_EXCEPT); // option parsing and setup leave host flags behind, the guest's fflags start clean
+  int ret = fuzz_input ? fuzz() : execute();
 
   // silent = 1;
   // for (uint32_t i = 0; i < x; i+=4)
@@ -908,6 +4314,23 @@ int main(int argc, char **argv)
   // silent = 0;
 
 
-  puts("end");
-  return 0;
+  if (run_result)
+  {
+    const char *why = run_result == RESULT_FAULT ? "memory fault" : (run_result == RESULT_ILLEGAL ? "illegal instruction" : "timeout");
+    printf("# program stopped: %s at pc 0x%"PRIx32" after %"PRIu64" instructions (exit code %d)\n", why, run_stop_pc, inst_count, run_result);
+  }
+
+  rr_finish(ret);
+  checkpoint_finish();
+
+  if (timing)
+    timing_report();
+
+  if (heat)
+    heat_report();
+
+  if (gdb_fd >= 0)
+    gdb_report_exit(ret);
+
+  return ret;
 }
\ No newline at end of file
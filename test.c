@@ -1,3 +1,5 @@
+#include "bulk.h"
+
 int blub = 8;
 
 int blub2[] = { 1,2,3,4,5,6,7,8,9 };
@@ -29,6 +31,10 @@ int _start()
     blub = blub3[i];
   }
 
+  int copy[9];
+  bulk_memcpy(copy, blub2, sizeof(copy)); // custom-0, runs on the host
+  blub = copy[8];
+
   // if (x != 111)
   // {
   //   //x = 77;